@@ -0,0 +1,330 @@
+/* Fleet benchmark: launches many waitexit instances at once, each under a
+   pty of its own, and aggregates the key=value lines they print at exit,
+   like those of --stats and --trace-startup, over all instances.
+
+   --stats is added to the arguments of every instance. Lines printed by
+   instances are read from their ptys, so lines of different instances never
+   mix. Derived per instance values are added to the --stats samples:
+
+     cpu_us         user_us + sys_us
+     csw            nvcsw + nivcsw
+     wakeups_per_s  wakeups per second the instance ran
+
+   For every value the mean, percentiles and maximum over all instances are
+   printed. The time of exec is passed to instances in
+   WAITEXIT_TRACE_EXEC_NS, so that --trace-startup includes loading.
+
+   Use: fleetbench [-n COUNT] [-j PARALLEL] [-k SECS] [-m TEXT] WAITEXIT [ARG..]
+
+     -n COUNT     number of instances to launch, default 100
+     -j PARALLEL  number of instances running at once, default COUNT
+     -k SECS      press a key in every instance SECS seconds after launch
+     -m TEXT      only print values whose name contains TEXT
+
+   Each pty counts against /proc/sys/kernel/pty/max, which is commonly 4096.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define NSEC_PER_SEC                  1000000000LL
+#define LINE_MAX_SIZE                 2048
+#define MAX_METRICS                   128
+
+static long long monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Samples of one value, named by line prefix and key. */
+typedef struct {
+  char name[64];
+  double* samples;
+  int count;
+  int cap;
+} Metric;
+
+static Metric metrics[MAX_METRICS];
+static int metric_count = 0;
+
+static void add_sample(const char* prefix, const char* key, size_t key_len, double value) {
+  char name[64];
+  snprintf(name, sizeof(name), "%s.%.*s", prefix, (int)key_len, key);
+  Metric* m = NULL;
+  for (int i = 0; i < metric_count && ! m; i++) {
+    if (strcmp(metrics[i].name, name) == 0) m = &metrics[i];
+  }
+  if (! m) {
+    if (metric_count == MAX_METRICS) return;
+    m = &metrics[metric_count++];
+    strcpy(m->name, name);
+  }
+  if (m->count == m->cap) {
+    m->cap = m->cap ? m->cap * 2 : 256;
+    m->samples = realloc(m->samples, m->cap * sizeof(double));
+    if (! m->samples) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  m->samples[m->count++] = value;
+}
+
+/* A running instance and the output read from its pty. */
+typedef struct {
+  pid_t pid;
+  int fd;
+  long long start_ns;
+  long long end_ns;
+  int key_sent;
+  char line[LINE_MAX_SIZE];
+  size_t line_len;
+} Instance;
+
+static int failed = 0;
+static const char* only_matching = NULL;
+
+/* Parses a line of "waitexit-NAME key=value ..." pairs into samples of
+   NAME.key. Values which are not numbers, and pid, are skipped. */
+static void parse_line(const Instance* in, char* line) {
+  char* start = strstr(line, "waitexit-");
+  if (! start) return;
+  char* prefix = start + 9;
+  char* p = prefix + strcspn(prefix, " ");
+  if (! *p) return;
+  *(p++) = 0;
+
+  double user_us = 0, sys_us = 0, nvcsw = 0, nivcsw = 0, wakeups = -1;
+  while (*p) {
+    char* key = p + strspn(p, " ");
+    char* eq = strchr(key, '=');
+    if (! eq) break;
+    char* end;
+    double value = strtod(eq + 1, &end);
+    p = end + strcspn(end, " ");
+    if (end == eq + 1 || (*end && *end != ' ')) continue;
+    const size_t key_len = eq - key;
+    if (key_len == 3 && strncmp(key, "pid", 3) == 0) continue;
+    add_sample(prefix, key, key_len, value);
+    if (strcmp(prefix, "stats") == 0) {
+      if (strncmp(key, "user_us=", 8) == 0) user_us = value;
+      else if (strncmp(key, "sys_us=", 7) == 0) sys_us = value;
+      else if (strncmp(key, "nvcsw=", 6) == 0) nvcsw = value;
+      else if (strncmp(key, "nivcsw=", 7) == 0) nivcsw = value;
+      else if (strncmp(key, "wakeups=", 8) == 0) wakeups = value;
+    }
+  }
+  if (strcmp(prefix, "stats") == 0) {
+    add_sample(prefix, "cpu_us", 6, user_us + sys_us);
+    add_sample(prefix, "csw", 3, nvcsw + nivcsw);
+    const long long ran_ns = (in->end_ns ? in->end_ns : monotonic_ns()) - in->start_ns;
+    if (wakeups >= 0 && ran_ns > 0) {
+      add_sample(prefix, "wakeups_per_s", 13, wakeups * NSEC_PER_SEC / ran_ns);
+    }
+  }
+}
+
+/* Reads pty output, parsing complete lines. Returns 0 when the pty is
+   closed. */
+static int read_output(Instance* in) {
+  char buf[4096];
+  ssize_t n = read(in->fd, buf, sizeof(buf));
+  if (n < 0 && errno == EAGAIN) {
+    return 1;
+  }
+  if (n <= 0) {
+    return 0;
+  }
+  for (ssize_t i = 0; i < n; i++) {
+    if (buf[i] == '\n' || in->line_len == LINE_MAX_SIZE - 1) {
+      in->line[in->line_len] = 0;
+      parse_line(in, in->line);
+      in->line_len = 0;
+    } else if (buf[i] != '\r') {
+      in->line[in->line_len++] = buf[i];
+    }
+  }
+  return 1;
+}
+
+/* Starts instance under a new pty, returns != 0 on success. */
+static int launch(Instance* in, char** argv) {
+  int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+    perror("posix_openpt");
+    if (master >= 0) close(master);
+    return 0;
+  }
+  struct winsize ws = { .ws_row = 24, .ws_col = 80 };
+  ioctl(master, TIOCSWINSZ, &ws);
+  const char* slave_name = ptsname(master);
+
+  in->start_ns = monotonic_ns();
+  in->end_ns = 0;
+  in->key_sent = 0;
+  in->line_len = 0;
+  in->pid = fork();
+  if (in->pid == 0) {
+    setsid();
+    int slave = open(slave_name, O_RDWR);
+    if (slave < 0) _exit(126);
+    dup2(slave, 0);
+    dup2(slave, 1);
+    dup2(slave, 2);
+    if (slave > 2) close(slave);
+    char exec_ns[32];
+    snprintf(exec_ns, sizeof(exec_ns), "%lld", monotonic_ns());
+    setenv("WAITEXIT_TRACE_EXEC_NS", exec_ns, 1);
+    execv(argv[0], argv);
+    _exit(127);
+  }
+  if (in->pid < 0) {
+    perror("fork");
+    close(master);
+    return 0;
+  }
+  fcntl(master, F_SETFL, O_NONBLOCK);
+  in->fd = master;
+  return 1;
+}
+
+static int compare_double(const void* a, const void* b) {
+  const double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static void print_summary(int launched, long long wall_ns) {
+  printf("fleetbench instances=%i failed=%i wall_s=%.2f\n", launched, failed, wall_ns / 1e9);
+  printf("%-34s %8s %12s %12s %12s %12s %12s\n", "value", "n", "mean", "p50", "p90", "p99", "max");
+  for (int i = 0; i < metric_count; i++) {
+    Metric* m = &metrics[i];
+    if (only_matching && ! strstr(m->name, only_matching)) continue;
+    qsort(m->samples, m->count, sizeof(double), compare_double);
+    double sum = 0;
+    for (int j = 0; j < m->count; j++) sum += m->samples[j];
+    printf("%-34s %8i %12.1f %12.1f %12.1f %12.1f %12.1f\n", m->name, m->count, sum / m->count,
+           m->samples[(m->count - 1) * 50 / 100], m->samples[(m->count - 1) * 90 / 100],
+           m->samples[(m->count - 1) * 99 / 100], m->samples[m->count - 1]);
+  }
+}
+
+int main(int argc, char** argv) {
+  int count = 100;
+  int parallel = 0;
+  double key_after = -1;
+  int c;
+  while ((c = getopt(argc, argv, "+n:j:k:m:")) != -1) {
+    switch (c) {
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 'j':
+      parallel = atoi(optarg);
+      break;
+    case 'k':
+      key_after = atof(optarg);
+      break;
+    case 'm':
+      only_matching = optarg;
+      break;
+    default:
+      return 1;
+    }
+  }
+  if (optind >= argc || count < 1) {
+    fprintf(stderr, "Use: %s [-n COUNT] [-j PARALLEL] [-k SECS] [-m TEXT] WAITEXIT [ARG..]\n", argv[0]);
+    return 1;
+  }
+  if (parallel < 1 || parallel > count) {
+    parallel = count;
+  }
+
+  // Every running instance holds a pty master open here
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+
+  const int nargs = argc - optind;
+  char** args = calloc(nargs + 2, sizeof(char*));
+  args[0] = argv[optind];
+  args[1] = "--stats";
+  memcpy(args + 2, argv + optind + 1, (nargs - 1) * sizeof(char*));
+
+  Instance* running = calloc(parallel, sizeof(Instance));
+  struct pollfd* fds = calloc(parallel, sizeof(struct pollfd));
+  if (! args || ! running || ! fds) {
+    perror("calloc");
+    return 1;
+  }
+  for (int i = 0; i < parallel; i++) {
+    running[i].pid = 0;
+    running[i].fd = -1;
+  }
+
+  const long long start = monotonic_ns();
+  int launched = 0;
+  int active = 0;
+  while (launched < count || active > 0) {
+    for (int i = 0; i < parallel && launched < count; i++) {
+      if (running[i].pid == 0 && running[i].fd < 0) {
+        if (! launch(&running[i], args)) {
+          return 1;
+        }
+        ++launched;
+        ++active;
+      }
+    }
+
+    const long long now = monotonic_ns();
+    for (int i = 0; i < parallel; i++) {
+      Instance* in = &running[i];
+      fds[i].fd = in->fd;
+      fds[i].events = POLLIN;
+      if (key_after >= 0 && in->fd >= 0 && ! in->key_sent && now - in->start_ns >= key_after * NSEC_PER_SEC) {
+        write(in->fd, "k", 1);
+        in->key_sent = 1;
+      }
+    }
+    poll(fds, parallel, key_after >= 0 ? 10 : 100);
+
+    for (int i = 0; i < parallel; i++) {
+      Instance* in = &running[i];
+      if (in->fd >= 0 && fds[i].revents && ! read_output(in)) {
+        close(in->fd);
+        in->fd = -1;
+      }
+    }
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      for (int i = 0; i < parallel; i++) {
+        if (running[i].pid == pid) {
+          running[i].end_ns = monotonic_ns();
+          running[i].pid = 0;
+          if (! WIFEXITED(status) || WEXITSTATUS(status) != 0) ++failed;
+        }
+      }
+    }
+    active = 0;
+    for (int i = 0; i < parallel; i++) {
+      if (running[i].pid != 0 || running[i].fd >= 0) ++active;
+    }
+  }
+
+  print_summary(launched, monotonic_ns() - start);
+  return 0;
+}
@@ -0,0 +1,67 @@
+/* Render microbenchmark: renders every template which has a specialized
+   renderer in a tight loop, with both the specialized and the generic
+   renderer, and prints the time per frame of each. The outputs of the two
+   are checked to be the same for every frame.
+
+   waitexit.c is included with its main renamed, so that the renderers and
+   templates are exactly those of the build.
+
+   Use: renderbench [FRAMES]
+*/
+
+#define main waitexit_main
+#include "../waitexit.c"
+#undef main
+
+/* Renders frames with renderer, returns nanoseconds per frame. The sum of
+   lengths keeps the loop from being optimized away. */
+static double time_renderer(TemplateRenderer renderer, const CompiledTemplate* ct, FrameValues* v,
+                            long frames, unsigned long* sum) {
+  char frame[FRAME_MAX_SIZE];
+  const long long start = monotonic_ns();
+  for (long i = 0; i < frames; i++) {
+    v->seconds_left = i & 0xffff;
+    *sum += renderer(frame, sizeof(frame), ct, v);
+  }
+  return (double)(monotonic_ns() - start) / frames;
+}
+
+int main(int argc, char** argv) {
+  const long frames = argc > 1 ? atol(argv[1]) : 10000000;
+  if (frames < 1) {
+    fprintf(stderr, "Use: %s [FRAMES]\n", argv[0]);
+    return 1;
+  }
+  FrameValues v = { 0 };
+  v.splay = 7;
+  v.queue = 3;
+  v.attempt = 2;
+  v.percent = 42;
+  v.processes = 5;
+  v.elapsed = 61;
+  v.lap = 4;
+  v.status_len = sprintf(v.status, "Loading 3 of 8 modules");
+
+  int failed = 0;
+  unsigned long sum = 0;
+  printf("%12s %12s %8s  %s\n", "specialized", "generic", "speedup", "template");
+  for (const SpecializedRenderer* r = specialized_renderers; r->template; r++) {
+    static CompiledTemplate ct;
+    compile_template(&ct, r->template);
+    for (int seconds = 0; seconds < 100000; seconds = seconds * 10 + 9) {
+      char expected[FRAME_MAX_SIZE], actual[FRAME_MAX_SIZE];
+      v.seconds_left = seconds;
+      const size_t expected_len = render_template(expected, sizeof(expected), &ct, &v);
+      const size_t actual_len = r->render(actual, sizeof(actual), &ct, &v);
+      if (actual_len != expected_len || strcmp(actual, expected) != 0) {
+        printf("FAIL %s\n  generic:     %s\n  specialized: %s\n", r->template, expected, actual);
+        failed = 1;
+      }
+    }
+    const double specialized_ns = time_renderer(r->render, &ct, &v, frames, &sum);
+    const double generic_ns = time_renderer(render_template, &ct, &v, frames, &sum);
+    printf("%9.1f ns %9.1f ns %7.2fx  %s\n", specialized_ns, generic_ns, generic_ns / specialized_ns, r->template);
+  }
+  fprintf(stderr, "renderbench frames=%ld checksum=%lu\n", frames, sum);
+  return failed;
+}
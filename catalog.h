@@ -0,0 +1,100 @@
+/* Translatable messages of waitexit, and the format of compiled message
+   catalogs.
+
+   A catalog is a binary file which is mapped into memory as is:
+
+     header     "WXC1", message count and layout hash, each 32 bit
+     offsets    one 32 bit offset from start of file per message, or 0 if
+                the message is not translated
+     strings    NUL terminated UTF-8 strings
+
+   Messages are numbered in the order listed below, so the message id is a
+   minimal perfect hash indexing the offsets directly. The layout hash is
+   computed from the message names, so that a catalog compiled for another
+   version is ignored rather than showing the wrong messages. */
+
+#ifndef WAITEXIT_CATALOG_H
+#define WAITEXIT_CATALOG_H
+
+#include <stdint.h>
+
+#define WAITEXIT_MESSAGES(MSG) \
+  MSG(ABOUT, "Prints a countdown in terminal while waiting to exit. When timer reaches zero or any input occurs, the program exits.") \
+  MSG(USAGE, "Use: %s [opts] N [-- COMMAND [ARG..]]") \
+  MSG(USAGE_N, "where N is number of seconds to wait. COMMAND is only used by options which run a command.") \
+  MSG(OPTIONS, "Options:") \
+  MSG(HELP_M, "Use a custom countdown message template, where '%S' is replaced by number of seconds left, and '%{file:PATH}' by the contents of file PATH, updated whenever the file changes. System metrics are available as '%{load1}', '%{load5}', '%{load15}', '%{runnable}' (runnable processes), '%{memfree}' and '%{memavail}' (MiB). '%{splay}' is replaced by seconds added by --splay.") \
+  MSG(HELP_E, "Exit with status CODE.") \
+  MSG(HELP_F, "Exit with status 0 if user presses a key within the timeout, otherwise exit with non-zero code.") \
+  MSG(HELP_Z, "Suppress printing of wait time and status code on exit.") \
+  MSG(HELP_S, "Be completely silent, do not output anything while waiting or on exit.") \
+  MSG(HELP_H, "Show this help.") \
+  MSG(HELP_MESSAGE_FILE, "Read the countdown message template from file PATH. The file is watched for changes while waiting, and the message is updated whenever the file is rewritten.") \
+  MSG(HELP_METRICS_INTERVAL, "Refresh system metrics shown in the message every SECS seconds, default is 5.") \
+  MSG(HELP_SPLAY, "Add a random delay of up to SECS seconds to the countdown, to spread out the load when many hosts wait for the same amount of time.") \
+  MSG(HELP_SPLAY_BY_HOST, "Derive the --splay delay from the host name instead, so that it is the same on every run on a host.") \
+  MSG(HELP_GATE, "Wait at most N seconds for a free slot in the concurrency gate DIR, then run COMMAND while holding the slot. Waiters are admitted in order of arrival, and '%{queue}' in the message is replaced by the number of waiters ahead. Exits with non-zero status if no slot was acquired.") \
+  MSG(HELP_GATE_SLOTS, "Number of slots in the concurrency gate, default is 1.") \
+  MSG(HELP_REPEAT, "Run COMMAND every N seconds on a fixed schedule, counting down to the next run in between, until a key is pressed. Exits with the status of the last run.") \
+  MSG(HELP_CATCH_UP, "With --repeat, make runs missed because a run took longer than N seconds right away, instead of skipping them.") \
+  MSG(HELP_RETRY, "Run COMMAND, and if it fails retry it up to MAX times, counting down a backoff delay between attempts. The delay starts at N seconds and doubles for every attempt, with random jitter. Press q to give up, or any other key to retry right away. '%{attempt}' in the message is replaced by the attempt number.") \
+  MSG(HELP_BACKOFF_MAX, "Limit the --retry backoff delay to SECS seconds.") \
+  MSG(HELP_PROGRESS, "Count down to the estimated time of completion of some work, waiting at most N seconds. SOURCE is a file, or fd:NUM for an open file descriptor, holding 'DONE TOTAL' or 'DONE/TOTAL'. The countdown ends when DONE reaches TOTAL. '%{percent}' in the message is replaced by percent done.") \
+  MSG(HELP_PROGRESS_INTERVAL, "Sample the --progress source every SECS seconds, default is 2.") \
+  MSG(HELP_NOTIFY, "Start COMMAND as a service with NOTIFY_SOCKET set, and wait at most N seconds for it to report READY=1 with sd_notify. '%{status}' in the message is replaced by the STATUS= text last reported. Exits with non-zero status if the service did not become ready.") \
+  MSG(HELP_STOPWATCH, "Count up instead, until q or Esc is pressed, or until N seconds have passed if N is given. Any other key records a lap. Lap times and a summary are printed at the end, unless -z is given. '%{elapsed}' in the message is replaced by seconds elapsed, and '%{lap}' by the lap number.") \
+  MSG(HELP_WAIT_PROCESS, "Wait at most N seconds until no process named NAME remains, or with cmdline:TEXT no process with TEXT in its command line. waitexit and its parent processes are not counted. '%{processes}' in the message is replaced by the number of processes left. Exits with non-zero status if any remain.") \
+  MSG(HELP_BUDGET, "Limit all waiting to SECS seconds from now. The absolute deadline is exported to commands run in WAITEXIT_DEADLINE, as seconds since the epoch. A deadline inherited that way always limits the countdown, so nested waits respect the outer limit.") \
+  MSG(HELP_CRON, "Count down to the next time matching cron expression EXPR, 'MIN HOUR DAY MONTH WEEKDAY', instead of N seconds. Changes of the system clock are followed. If N is given too, the countdown ends after at most N seconds.") \
+  MSG(HELP_RENDER_THREAD, "Render and write the countdown message on a separate thread, so that key presses are handled right away even when the terminal is slow. A key press waits at most a tenth of a second for the terminal to take the last message.") \
+  MSG(HELP_EARLY_WAKE, "Compensate for scheduler latency by arming timers early by the PCT percentile of the lateness of recent wakeups, and spinning the rest of the way, so that frames are shown on time.") \
+  MSG(HELP_INPUT_DEVICE, "Also end the countdown when a key is pressed on input device PATH, like /dev/input/event0, even if the terminal does not have keyboard focus. Can be given up to 8 times.") \
+  MSG(HELP_INPUT_KEYS, "Only accept keys with the given comma separated key codes from input devices, as listed in linux/input-event-codes.h, for instance 28,57 for Enter and Space.") \
+  MSG(HELP_SYSLOG, "Send the outcome to syslog at exit, as a single message of key=value pairs holding LABEL, the reason the countdown ended, or the outcome of --repeat, --retry or --stopwatch, elapsed seconds and exit status. Sending never delays exit, and the message is dropped if syslog is not ready to receive it.") \
+  MSG(HELP_SYSLOG_SOCKET, "Send the --syslog message to datagram socket PATH instead of /dev/log.") \
+  MSG(HELP_DUMP_FD, "Write the current state and timing counters as one line of key=value pairs to file descriptor FD instead of stderr when SIGUSR1 is received. The countdown itself is not disturbed.") \
+  MSG(HELP_STATS, "Print CPU time, context switches, wakeups, frames and bytes written, memory use, expiry lateness, the distribution of tick lateness and key press to exit latency on stderr at exit, as one line of key=value pairs.") \
+  MSG(HELP_TRACE_STARTUP, "Print the time taken to reach each startup phase, from exec or program load to the first countdown message, on stderr at exit, as one line of key=value pairs. Set WAITEXIT_TRACE_EXEC_NS to the CLOCK_MONOTONIC time of exec in nanoseconds to include dynamic loading.") \
+  MSG(HELP_COPROC, "Run as a coprocess, serving countdown requests read line by line from stdin. Each line holds options and N as on the command line, and is answered on stdout with a line 'EXITCODE ELAPSED REASON'. The countdown is shown on the controlling terminal. A --budget in a request only limits that request, and --syslog given to the coprocess applies to requests without their own. --stats and --trace-startup cover the whole coprocess, and can only be given to it.") \
+  MSG(TEMPLATE, "Waiting for %S seconds, press any key to exit..") \
+  MSG(TEMPLATE_GATE, "Waiting for a free slot, %{queue} ahead, %S seconds left, press any key to give up..") \
+  MSG(TEMPLATE_REPEAT, "Next run in %S seconds, press any key to stop..") \
+  MSG(TEMPLATE_PROGRESS, "%{percent}% done, about %S seconds left, press any key to exit..") \
+  MSG(TEMPLATE_NOTIFY, "Waiting for service to be ready, %S seconds left.. %{status}") \
+  MSG(TEMPLATE_RETRY, "Attempt %{attempt} failed, retrying in %S seconds, press q to give up or any other key to retry now..") \
+  MSG(TEMPLATE_WAIT_PROCESS, "Waiting for %{processes} processes to exit, %S seconds left, press any key to stop..") \
+  MSG(TEMPLATE_STOPWATCH, "%{elapsed} seconds elapsed in lap %{lap}, press any key for a new lap or q to stop..") \
+  MSG(EXIT_INFO, "Exit %i after %i seconds.") \
+  MSG(REPEAT_SUMMARY, "Ran %lu times, skipped %lu, last exit status %i.") \
+  MSG(STOPWATCH_LAP, "Lap %i: %.3f seconds, at %.3f seconds.") \
+  MSG(STOPWATCH_SUMMARY, "%i laps in %.3f seconds, shortest %.3f, median %.3f, mean %.3f, longest %.3f seconds.") \
+  MSG(RETRY_ATTEMPT, "Attempt %i: exit %i after %.3f seconds.") \
+  MSG(RETRY_SUCCEEDED, "Succeeded on attempt %i.") \
+  MSG(RETRY_GAVE_UP, "Gave up on attempt %i, last exit status %i.") \
+  MSG(RETRY_ABORTED, "Aborted on attempt %i, last exit status %i.")
+
+#define MSG_ENUM(id, text) MSG_##id,
+enum { WAITEXIT_MESSAGES(MSG_ENUM) MSG_COUNT };
+#undef MSG_ENUM
+
+#define CATALOG_MAGIC "WXC1"
+
+typedef struct {
+  char magic[4];
+  uint32_t count;
+  uint32_t layout;
+} CatalogHeader;
+
+/* FNV-1a hash of the message names, identifying the catalog layout. */
+static inline uint32_t catalog_layout_hash(const char* const* names, int count) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < count; i++) {
+    for (const char* p = names[i]; *p; p++) {
+      hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    hash = (hash ^ '\n') * 16777619u;
+  }
+  return hash;
+}
+
+#endif
@@ -0,0 +1,129 @@
+/* Compiles a message catalog source file into the binary format described in
+   catalog.h.
+
+   The source holds one translated message per line, as the message name
+   followed by white space and the text. Empty lines and lines starting with
+   '#' are ignored, and messages not listed are shown untranslated.
+
+   Use: mkcatalog SOURCE OUTPUT
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "catalog.h"
+
+#define MSG_NAME(id, text) #id,
+static const char* const names[] = { WAITEXIT_MESSAGES(MSG_NAME) };
+#undef MSG_NAME
+
+#define MSG_TEXT(id, text) text,
+static const char* const originals[] = { WAITEXIT_MESSAGES(MSG_TEXT) };
+#undef MSG_TEXT
+
+/* Returns the conversion specifications of a printf format, each up to and
+   including the conversion character and followed by a space, which must be
+   the same in a translation to keep formats working. Templates only have %S
+   conversions, any other '%' is taken literally there. */
+static void conversions(const char* text, int template, char* out, size_t cap) {
+  size_t n = 0;
+  for (const char* p = text; *p && n + 2 < cap; p++) {
+    if (*p != '%') continue;
+    if (template) {
+      if (p[1] == 'S') {
+        out[n++] = 'S';
+        out[n++] = ' ';
+        ++p;
+      }
+      continue;
+    }
+    ++p;
+    while (*p && strchr("-+ #0123456789.*hlLqjzt", *p) && n + 2 < cap) {
+      out[n++] = *(p++);
+    }
+    if (! *p) break;
+    out[n++] = *p;
+    out[n++] = ' ';
+  }
+  out[n] = 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    fprintf(stderr, "Use: %s SOURCE OUTPUT\n", argv[0]);
+    return 1;
+  }
+  FILE* in = fopen(argv[1], "r");
+  if (! in) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  char* translations[MSG_COUNT] = { NULL };
+  char line[4096];
+  int lineno = 0;
+  int errors = 0;
+  while (fgets(line, sizeof(line), in)) {
+    ++lineno;
+    line[strcspn(line, "\n")] = 0;
+    char* name = line;
+    while (isspace(*name)) ++name;
+    if (*name == 0 || *name == '#') continue;
+    char* text = name + strcspn(name, " \t");
+    if (*text) *(text++) = 0;
+    while (isspace(*text)) ++text;
+
+    int id = 0;
+    while (id < MSG_COUNT && strcmp(names[id], name) != 0) id++;
+    if (id == MSG_COUNT) {
+      fprintf(stderr, "%s:%i: unknown message %s\n", argv[1], lineno, name);
+      ++errors;
+      continue;
+    }
+    if (translations[id]) {
+      fprintf(stderr, "%s:%i: duplicate message %s\n", argv[1], lineno, name);
+      ++errors;
+      continue;
+    }
+    char expected[64], actual[64];
+    const int template = strncmp(name, "TEMPLATE", 8) == 0;
+    conversions(originals[id], template, expected, sizeof(expected));
+    conversions(text, template, actual, sizeof(actual));
+    if (strcmp(expected, actual) != 0) {
+      fprintf(stderr, "%s:%i: %% conversions of %s differ from the original\n", argv[1], lineno, name);
+      ++errors;
+      continue;
+    }
+    translations[id] = strdup(text);
+  }
+  fclose(in);
+  if (errors) {
+    return 1;
+  }
+
+  CatalogHeader header = { .count = MSG_COUNT, .layout = catalog_layout_hash(names, MSG_COUNT) };
+  memcpy(header.magic, CATALOG_MAGIC, sizeof(header.magic));
+  uint32_t offsets[MSG_COUNT];
+  uint32_t offset = sizeof(header) + sizeof(offsets);
+  for (int id = 0; id < MSG_COUNT; id++) {
+    offsets[id] = translations[id] ? offset : 0;
+    if (translations[id]) offset += strlen(translations[id]) + 1;
+  }
+
+  FILE* out = fopen(argv[2], "wb");
+  if (! out) {
+    perror(argv[2]);
+    return 1;
+  }
+  fwrite(&header, sizeof(header), 1, out);
+  fwrite(offsets, sizeof(offsets), 1, out);
+  for (int id = 0; id < MSG_COUNT; id++) {
+    if (translations[id]) fwrite(translations[id], strlen(translations[id]) + 1, 1, out);
+  }
+  if (fclose(out) != 0) {
+    perror(argv[2]);
+    return 1;
+  }
+  return 0;
+}
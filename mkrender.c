@@ -0,0 +1,181 @@
+/* Generates specialized render functions for message templates known at build
+   time: the default templates from catalog.h, and site templates read from
+   the files given as arguments, one template per line. Lines starting with
+   '#' are ignored.
+
+   A specialized renderer copies literals of fixed length and formats numbers
+   in place, with no segment interpretation. Templates using placeholders
+   whose values are not simple numbers or a single string are left to the
+   generic renderer.
+
+   Use: mkrender [SITE_TEMPLATES..] > renderers.h
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "catalog.h"
+
+#define MSG_ENTRY(id, text) { #id, text },
+static const struct {
+  const char* name;
+  const char* text;
+} messages[] = { WAITEXIT_MESSAGES(MSG_ENTRY) };
+#undef MSG_ENTRY
+
+/* Placeholders a specialized renderer can handle, with the expression for
+   their value. Numbers take at most 10 chars. */
+static const struct {
+  const char* name;
+  const char* number;
+} numbers[] = {
+  { "queue", "v->queue" },
+  { "attempt", "v->attempt" },
+  { "percent", "v->percent" },
+  { "processes", "v->processes" },
+  { "splay", "v->splay" },
+  { "elapsed", "v->elapsed" },
+  { "lap", "v->lap" },
+};
+
+static int renderers = 0;
+
+static void print_c_string(const char* s, size_t len) {
+  putchar('"');
+  for (size_t i = 0; i < len; i++) {
+    const unsigned char c = s[i];
+    if (c == '"' || c == '\\') {
+      printf("\\%c", c);
+    } else if (c < 32 || c >= 127 || c == '?') {
+      printf("\\%03o", c);
+    } else {
+      putchar(c);
+    }
+  }
+  putchar('"');
+}
+
+/* Emits the literal text preceding a placeholder, if any, and counts its
+   length. Nothing is emitted in the checking pass. */
+static void emit_literal(int pass, const char* text, size_t len, size_t* max_len) {
+  *max_len += len;
+  if (len == 0 || pass == 0) return;
+  printf("  memcpy(p, ");
+  print_c_string(text, len);
+  printf(", %zu);\n  p += %zu;\n", len, len);
+}
+
+/* Emits renderer for template, returns != 0 if it could be specialized. */
+static int emit_renderer(const char* template) {
+  // Same parsing as compile_template(), checked in a first pass
+  char literal[1024];
+  size_t literal_len = 0;
+  size_t max_len = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    const size_t checked_max_len = max_len;
+    max_len = 0;
+    literal_len = 0;
+    if (pass == 1) {
+      printf("\n/* ");
+      for (const char* t = template; *t; t++) {
+        putchar(*t == '*' && t[1] == '/' ? '+' : *t);
+      }
+      printf(" */\nstatic size_t render_specialized_%i(char* dst, size_t cap, const CompiledTemplate* ct, const FrameValues* v) {\n", renderers);
+      printf("  if (cap <= %zu) {\n    return render_template(dst, cap, ct, v);\n  }\n  char* p = dst;\n", checked_max_len);
+    }
+    for (const char* p = template; *p; p++) {
+      if (*p == '\n' || *p == '\r') continue;
+      if (*p == '%' && p[1] == 'S') {
+        emit_literal(pass, literal, literal_len, &max_len);
+        if (pass == 1) {
+          printf("  p += format_uint(p, v->seconds_left);\n");
+        }
+        literal_len = 0;
+        max_len += 10;
+        ++p;
+        continue;
+      }
+      if (*p == '%' && p[1] == '{') {
+        const char* name = p + 2;
+        const char* close = strchr(name, '}');
+        int known = 0;
+        for (int i = 0; close && i < sizeof(numbers) / sizeof(numbers[0]); i++) {
+          if (strlen(numbers[i].name) == close - name && strncmp(name, numbers[i].name, close - name) == 0) {
+            emit_literal(pass, literal, literal_len, &max_len);
+            if (pass == 1) {
+              printf("  p += format_uint(p, %s);\n", numbers[i].number);
+            }
+            max_len += 10;
+            known = 1;
+          }
+        }
+        if (close && ! known && close - name == 6 && strncmp(name, "status", 6) == 0) {
+          emit_literal(pass, literal, literal_len, &max_len);
+          if (pass == 1) {
+            printf("  memcpy(p, v->status, v->status_len);\n  p += v->status_len;\n");
+          }
+          max_len += 255;
+          known = 1;
+        }
+        if (! known) {
+          // Other placeholders, or text compile_template() takes literally
+          return 0;
+        }
+        literal_len = 0;
+        p = close;
+        continue;
+      }
+      if (literal_len == sizeof(literal)) {
+        return 0;
+      }
+      literal[literal_len++] = *p;
+    }
+    emit_literal(pass, literal, literal_len, &max_len);
+    if (pass == 1) {
+      printf("  *p = 0;\n  return p - dst;\n}\n");
+    }
+  }
+  return 1;
+}
+
+int main(int argc, char** argv) {
+  const char* templates[256];
+  int ntemplates = 0;
+  for (int i = 0; i < sizeof(messages) / sizeof(messages[0]); i++) {
+    if (strncmp(messages[i].name, "TEMPLATE", 8) == 0) {
+      templates[ntemplates++] = messages[i].text;
+    }
+  }
+  for (int i = 1; i < argc; i++) {
+    FILE* in = fopen(argv[i], "r");
+    if (! in) {
+      perror(argv[i]);
+      return 1;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), in) && ntemplates < 256) {
+      line[strcspn(line, "\n")] = 0;
+      if (line[0] == 0 || line[0] == '#') continue;
+      templates[ntemplates++] = strdup(line);
+    }
+    fclose(in);
+  }
+
+  printf("/* Generated by mkrender, do not edit. */\n");
+  const char* specialized[256];
+  for (int i = 0; i < ntemplates; i++) {
+    if (emit_renderer(templates[i])) {
+      specialized[renderers++] = templates[i];
+    } else {
+      fprintf(stderr, "mkrender: not specialized: %s\n", templates[i]);
+    }
+  }
+  printf("\nstatic const SpecializedRenderer specialized_renderers[] = {\n");
+  for (int i = 0; i < renderers; i++) {
+    printf("  { ");
+    print_c_string(specialized[i], strlen(specialized[i]));
+    printf(", render_specialized_%i },\n", i);
+  }
+  printf("  { NULL, NULL }\n};\n");
+  return 0;
+}
@@ -0,0 +1,95 @@
+/* Checks parse_cron and next_cron_time against known expressions, in UTC.
+   Exits with non-zero status if any check fails.
+
+   waitexit.c is included with its main renamed, so that the functions
+   checked are exactly those of the build.
+
+   Use: crontest
+*/
+
+#define main waitexit_main
+#include "../waitexit.c"
+#undef main
+
+typedef struct {
+  const char* expr;
+  const char* start;  // YYYY-MM-DD HH:MM
+  const char* next;   // YYYY-MM-DD HH:MM, "never" or "invalid"
+} CronCheck;
+
+static const CronCheck cron_checks[] = {
+  { "30 * * * *", "2026-10-18 10:00", "2026-10-18 10:30" },
+  { "30 * * * *", "2026-10-18 10:30", "2026-10-18 11:30" },
+  { "0 10 * * *", "2026-10-18 10:00", "2026-10-19 10:00" },
+  { "*/15 9-17 * * 1-5", "2026-10-18 10:00", "2026-10-19 09:00" },
+  { "*/15 9-17 * * 1-5", "2026-10-19 17:45", "2026-10-20 09:00" },
+  { "0 0 1 1 *", "2026-10-18 10:00", "2027-01-01 00:00" },
+  { "59 23 31 12 *", "2026-12-31 23:59", "2027-12-31 23:59" },
+  // Leap day, skipping 2027
+  { "0 0 29 2 *", "2026-10-18 10:00", "2028-02-29 00:00" },
+  // Day of month or weekday when both are restricted: the next Friday...
+  { "0 12 13 * 5", "2026-10-18 10:00", "2026-10-23 12:00" },
+  // ...or the 13th, which is a Sunday
+  { "0 12 13 * 5", "2026-12-12 13:00", "2026-12-13 12:00" },
+  // Only the weekday when the day of month is '*'
+  { "0 12 * * 5", "2026-12-12 13:00", "2026-12-18 12:00" },
+  // Sunday as both 0 and 7
+  { "0 0 * * 7", "2026-10-18 10:00", "2026-10-25 00:00" },
+  { "0 0 * * 0", "2026-10-18 10:00", "2026-10-25 00:00" },
+  { "0 0 * * 5-7", "2026-10-18 10:00", "2026-10-23 00:00" },
+  { "0 0 31 4 *", "2026-10-18 10:00", "never" },
+  { "0 0 30 2 *", "2026-10-18 10:00", "never" },
+  { "60 * * * *", NULL, "invalid" },
+  { "* 24 * * *", NULL, "invalid" },
+  { "* * 0 * *", NULL, "invalid" },
+  { "* * * 13 *", NULL, "invalid" },
+  { "* * * * 8", NULL, "invalid" },
+  { "* * * *", NULL, "invalid" },
+  { "* * * * * *", NULL, "invalid" },
+  { "5-1 * * * *", NULL, "invalid" },
+  { "*/0 * * * *", NULL, "invalid" },
+  { "1- * * * *", NULL, "invalid" },
+  { NULL, NULL, NULL }
+};
+
+static time_t parse_time(const char* s) {
+  struct tm tm = { 0 };
+  sscanf(s, "%d-%d-%d %d:%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min);
+  tm.tm_year -= 1900;
+  tm.tm_mon -= 1;
+  tm.tm_isdst = -1;
+  return mktime(&tm);
+}
+
+static void format_time(char* buf, size_t size, time_t t) {
+  struct tm tm;
+  if (t < 0) {
+    snprintf(buf, size, "never");
+  } else {
+    localtime_r(&t, &tm);
+    strftime(buf, size, "%Y-%m-%d %H:%M", &tm);
+  }
+}
+
+int main(void) {
+  setenv("TZ", "UTC", 1);
+  tzset();
+  int checks = 0, failed = 0;
+  for (const CronCheck* c = cron_checks; c->expr; c++, checks++) {
+    CronSpec cron;
+    char next[32];
+    if (! parse_cron(c->expr, &cron)) {
+      snprintf(next, sizeof(next), "invalid");
+    } else if (c->start) {
+      format_time(next, sizeof(next), next_cron_time(&cron, parse_time(c->start)));
+    } else {
+      snprintf(next, sizeof(next), "valid");
+    }
+    if (strcmp(next, c->next) != 0) {
+      printf("FAIL \"%s\" after %s: %s, expected %s\n", c->expr, c->start ? c->start : "-", next, c->next);
+      failed++;
+    }
+  }
+  printf("%i of %i cron checks passed\n", checks - failed, checks);
+  return failed != 0;
+}
@@ -0,0 +1,446 @@
+/* Runs scripted scenarios of waitexit under a pty, checking the frames and
+   output shown, the exit status and performance budgets. Exits with
+   non-zero status if any scenario fails.
+
+   A scenario file holds one command per line, with arguments separated by
+   white space. Arguments may be double quoted, with \n, \r, \t, \e, \\, \"
+   and \xHH escapes. Lines starting with '#' are ignored.
+
+     run ARG..            arguments of waitexit
+     size COLS ROWS       terminal size, default 80 24
+     env NAME VALUE       set environment variable for waitexit
+     key SECS TEXT        type TEXT SECS seconds after start
+     frame TEXT           expect a frame showing exactly TEXT
+     output TEXT          expect TEXT in the output
+     exit CODE            expect exit status CODE, default 0
+     timeout SECS         kill waitexit after SECS seconds, default 30
+     budget NAME LIMIT    fail if NAME exceeds LIMIT
+
+   Frames and output are expected in the order given, each after the
+   previous one. Budgets are:
+
+     bytes_per_tick       bytes written per second of the run
+     syscalls_per_tick    system calls per second of the wait loop, counted
+                          from the first ppoll on, in all threads
+     key_to_exit_ms       time from the last key typed until exit
+
+   System calls are only traced with ptrace when there is a budget for
+   them.
+
+   Use: ptyrun WAITEXIT SCENARIO..
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/ptrace.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#define NSEC_PER_SEC                  1000000000LL
+#define NSEC_PER_MSEC                 1000000LL
+
+#define MAX_ARGS                      64
+#define MAX_ENV                       16
+#define MAX_KEYS                      16
+#define MAX_EXPECTS                   32
+#define TEXT_MAX_SIZE                 512
+#define OUTPUT_MAX_SIZE               (1 << 20)
+
+#define EXPECT_FRAME                  0
+#define EXPECT_OUTPUT                 1
+
+#define BUDGET_BYTES_PER_TICK         0
+#define BUDGET_SYSCALLS_PER_TICK      1
+#define BUDGET_KEY_TO_EXIT_MS         2
+#define BUDGET_COUNT                  3
+
+static const char* const budget_names[BUDGET_COUNT] = { "bytes_per_tick", "syscalls_per_tick", "key_to_exit_ms" };
+
+typedef struct {
+  char text[TEXT_MAX_SIZE];
+  size_t len;
+} Text;
+
+typedef struct {
+  char* args[MAX_ARGS + 2];
+  int nargs;
+  unsigned short cols;
+  unsigned short rows;
+  char* env[MAX_ENV];
+  int nenv;
+  double key_at[MAX_KEYS];
+  Text keys[MAX_KEYS];
+  int nkeys;
+  int expect_kinds[MAX_EXPECTS];
+  Text expects[MAX_EXPECTS];
+  int nexpects;
+  int exitcode;
+  double timeout;
+  double budgets[BUDGET_COUNT];
+} Scenario;
+
+static long long monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Reads next argument from *p into word, unquoting and unescaping it.
+   Returns 0 if there are no more arguments. */
+static int next_word(const char** p, Text* word) {
+  while (isspace(**p)) ++*p;
+  if (! **p || **p == '#') {
+    return 0;
+  }
+  const int quoted = **p == '"';
+  if (quoted) ++*p;
+  word->len = 0;
+  while (**p && (quoted ? **p != '"' : ! isspace(**p)) && word->len < TEXT_MAX_SIZE - 1) {
+    char c = *(*p)++;
+    if (c == '\\' && **p) {
+      c = *(*p)++;
+      switch (c) {
+      case 'n': c = '\n'; break;
+      case 'r': c = '\r'; break;
+      case 't': c = '\t'; break;
+      case 'e': c = 27; break;
+      case 'x': {
+        char hex[3] = { 0 };
+        for (int i = 0; i < 2 && isxdigit(**p); i++) hex[i] = *(*p)++;
+        c = strtol(hex, NULL, 16);
+        break;
+      }
+      }
+    }
+    word->text[word->len++] = c;
+  }
+  if (quoted && **p == '"') ++*p;
+  word->text[word->len] = 0;
+  return 1;
+}
+
+/* Parses scenario file, returns != 0 on success. */
+static int load_scenario(const char* path, Scenario* sc) {
+  FILE* in = fopen(path, "r");
+  if (! in) {
+    perror(path);
+    return 0;
+  }
+  memset(sc, 0, sizeof(*sc));
+  sc->cols = 80;
+  sc->rows = 24;
+  sc->timeout = 30;
+  for (int i = 0; i < BUDGET_COUNT; i++) sc->budgets[i] = -1;
+
+  char line[4096];
+  int lineno = 0;
+  int ok = 1;
+  while (ok && fgets(line, sizeof(line), in)) {
+    ++lineno;
+    const char* p = line;
+    Text cmd, a, b;
+    if (! next_word(&p, &cmd)) continue;
+    if (strcmp(cmd.text, "run") == 0) {
+      while (sc->nargs < MAX_ARGS && next_word(&p, &a)) {
+        sc->args[1 + sc->nargs++] = strdup(a.text);
+      }
+    } else if (strcmp(cmd.text, "size") == 0 && next_word(&p, &a) && next_word(&p, &b)) {
+      sc->cols = atoi(a.text);
+      sc->rows = atoi(b.text);
+    } else if (strcmp(cmd.text, "env") == 0 && sc->nenv < MAX_ENV && next_word(&p, &a) && next_word(&p, &b)) {
+      char* var = malloc(a.len + b.len + 2);
+      sprintf(var, "%s=%s", a.text, b.text);
+      sc->env[sc->nenv++] = var;
+    } else if (strcmp(cmd.text, "key") == 0 && sc->nkeys < MAX_KEYS && next_word(&p, &a) && next_word(&p, &sc->keys[sc->nkeys])) {
+      sc->key_at[sc->nkeys++] = atof(a.text);
+    } else if ((strcmp(cmd.text, "frame") == 0 || strcmp(cmd.text, "output") == 0)
+               && sc->nexpects < MAX_EXPECTS && next_word(&p, &sc->expects[sc->nexpects])) {
+      sc->expect_kinds[sc->nexpects++] = cmd.text[0] == 'f' ? EXPECT_FRAME : EXPECT_OUTPUT;
+    } else if (strcmp(cmd.text, "exit") == 0 && next_word(&p, &a)) {
+      sc->exitcode = atoi(a.text);
+    } else if (strcmp(cmd.text, "timeout") == 0 && next_word(&p, &a)) {
+      sc->timeout = atof(a.text);
+    } else if (strcmp(cmd.text, "budget") == 0 && next_word(&p, &a) && next_word(&p, &b)) {
+      int budget = 0;
+      while (budget < BUDGET_COUNT && strcmp(budget_names[budget], a.text) != 0) budget++;
+      if (budget == BUDGET_COUNT) {
+        fprintf(stderr, "%s:%i: unknown budget %s\n", path, lineno, a.text);
+        ok = 0;
+      } else {
+        sc->budgets[budget] = atof(b.text);
+      }
+    } else {
+      fprintf(stderr, "%s:%i: invalid command\n", path, lineno);
+      ok = 0;
+    }
+  }
+  fclose(in);
+  return ok;
+}
+
+/* Outcome of running a scenario. */
+typedef struct {
+  char* output;
+  size_t len;
+  int status;
+  int timed_out;
+  long long run_ns;
+  long long loop_ns;
+  long long key_to_exit_ns;
+  unsigned long syscalls;
+  int traced;
+} Run;
+
+/* Handles stops of traced threads, counting system calls entered from the
+   first ppoll on. */
+static void handle_trace_stop(pid_t pid, int status, Run* run, long long* loop_start) {
+  int deliver = 0;
+  const int sig = WSTOPSIG(status);
+  if (sig == (SIGTRAP | 0x80)) {
+    struct __ptrace_syscall_info info;
+    if (ptrace(PTRACE_GET_SYSCALL_INFO, pid, sizeof(info), &info) > 0 && info.op == PTRACE_SYSCALL_INFO_ENTRY) {
+      if (! *loop_start && info.entry.nr == SYS_ppoll) {
+        *loop_start = monotonic_ns();
+      }
+      if (*loop_start) {
+        ++run->syscalls;
+      }
+    }
+  } else if (sig == SIGTRAP && ! run->traced) {
+    // Stop at exec
+    ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL | PTRACE_O_TRACECLONE);
+    run->traced = 1;
+  } else if (! (status >> 16) && sig != SIGTRAP && sig != SIGSTOP) {
+    deliver = sig;
+  }
+  ptrace(PTRACE_SYSCALL, pid, 0, deliver);
+}
+
+/* Runs waitexit for scenario under a new pty, returns != 0 if it could be
+   started. */
+static int run_scenario(const char* waitexit, Scenario* sc, Run* run) {
+  memset(run, 0, sizeof(*run));
+  const int trace = sc->budgets[BUDGET_SYSCALLS_PER_TICK] >= 0;
+  int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+    perror("posix_openpt");
+    return 0;
+  }
+  struct winsize ws = { .ws_row = sc->rows, .ws_col = sc->cols };
+  ioctl(master, TIOCSWINSZ, &ws);
+  const char* slave_name = ptsname(master);
+
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  int sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+  sc->args[0] = (char*)waitexit;
+  sc->args[1 + sc->nargs] = NULL;
+  const long long start = monotonic_ns();
+  pid_t pid = fork();
+  if (pid == 0) {
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    setsid();
+    int slave = open(slave_name, O_RDWR);
+    if (slave < 0) _exit(126);
+    dup2(slave, 0);
+    dup2(slave, 1);
+    dup2(slave, 2);
+    if (slave > 2) close(slave);
+    for (int i = 0; i < sc->nenv; i++) putenv(sc->env[i]);
+    if (trace && ptrace(PTRACE_TRACEME, 0, 0, 0) < 0) _exit(125);
+    execv(waitexit, sc->args);
+    _exit(127);
+  }
+  if (pid < 0 || sigfd < 0) {
+    perror("fork");
+    return 0;
+  }
+
+  run->output = malloc(OUTPUT_MAX_SIZE);
+  long long loop_start = 0;
+  long long last_key = 0;
+  long long exit_ns = 0;
+  int next_key = 0;
+  int pty_open = 1;
+  while (pty_open || ! exit_ns) {
+    const long long now = monotonic_ns();
+    if (! exit_ns && now - start > sc->timeout * NSEC_PER_SEC) {
+      kill(pid, SIGKILL);
+      run->timed_out = 1;
+    }
+    while (next_key < sc->nkeys && now - start >= sc->key_at[next_key] * NSEC_PER_SEC) {
+      write(master, sc->keys[next_key].text, sc->keys[next_key].len);
+      last_key = monotonic_ns();
+      ++next_key;
+    }
+    long long timeout_ms = 50;
+    if (next_key < sc->nkeys) {
+      const long long due_ms = (start + sc->key_at[next_key] * NSEC_PER_SEC - now) / NSEC_PER_MSEC;
+      if (due_ms < timeout_ms) timeout_ms = due_ms > 0 ? due_ms : 0;
+    }
+    struct pollfd fds[2] = { { pty_open ? master : -1, POLLIN, 0 }, { sigfd, POLLIN, 0 } };
+    poll(fds, 2, timeout_ms);
+
+    if (fds[0].revents) {
+      const size_t room = OUTPUT_MAX_SIZE - 1 - run->len;
+      ssize_t n = read(master, run->output + run->len, room ? room : 1);
+      if (n > 0 && room) {
+        run->len += n;
+      } else if (n <= 0 && errno != EAGAIN && errno != EINTR) {
+        pty_open = 0;
+      }
+    }
+    if (fds[1].revents) {
+      struct signalfd_siginfo si;
+      while (read(sigfd, &si, sizeof(si)) == sizeof(si));
+    }
+    int status;
+    pid_t p;
+    while ((p = waitpid(-1, &status, __WALL | WNOHANG)) > 0) {
+      if (WIFSTOPPED(status)) {
+        handle_trace_stop(p, status, run, &loop_start);
+      } else if (p == pid) {
+        exit_ns = monotonic_ns();
+        run->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+      }
+    }
+  }
+  close(master);
+  close(sigfd);
+  sigprocmask(SIG_UNBLOCK, &mask, NULL);
+
+  run->output[run->len] = 0;
+  run->run_ns = exit_ns - start;
+  run->loop_ns = loop_start ? exit_ns - loop_start : 0;
+  run->key_to_exit_ns = last_key ? exit_ns - last_key : -1;
+  return 1;
+}
+
+/* Finds frame showing exactly text at or after from, returns offset after
+   it or -1. */
+static long find_frame(const char* output, size_t len, size_t from, const Text* text) {
+  for (const char* p = output + from; (p = strstr(p, "\r\033[K")); p += 4) {
+    const char* f = p + 4;
+    if (output + len - f >= text->len && memcmp(f, text->text, text->len) == 0) {
+      const char after = f[text->len];
+      if (after == 0 || after == '\r' || after == '\n') {
+        return f + text->len - output;
+      }
+    }
+  }
+  return -1;
+}
+
+/* Prints output with control characters escaped. */
+static void print_escaped(const char* s, size_t len) {
+  for (size_t i = 0; i < len && i < 4096; i++) {
+    const unsigned char c = s[i];
+    if (c == '\n') fputs("\\n\n", stderr);
+    else if (c == '\r') fputs("\\r", stderr);
+    else if (c == 27) fputs("\\e", stderr);
+    else if (c < 32) fprintf(stderr, "\\x%02x", c);
+    else fputc(c, stderr);
+  }
+  fputc('\n', stderr);
+}
+
+/* Ticks of a run are its whole seconds, at least one. */
+static double ticks(long long ns) {
+  const long long t = (ns + NSEC_PER_SEC / 2) / NSEC_PER_SEC;
+  return t > 0 ? t : 1;
+}
+
+/* Runs scenario and reports result, returns != 0 if it passed. */
+static int check_scenario(const char* waitexit, const char* path) {
+  Scenario sc;
+  Run run;
+  if (! load_scenario(path, &sc) || ! run_scenario(waitexit, &sc, &run)) {
+    printf("FAIL %s\n", path);
+    return 0;
+  }
+
+  int failures = 0;
+  if (run.timed_out) {
+    printf("FAIL %s: timed out after %.0f seconds\n", path, sc.timeout);
+    ++failures;
+  } else if (run.status != sc.exitcode) {
+    printf("FAIL %s: exit status %i, expected %i\n", path, run.status, sc.exitcode);
+    ++failures;
+  }
+  size_t cursor = 0;
+  for (int i = 0; i < sc.nexpects; i++) {
+    const Text* t = &sc.expects[i];
+    long found;
+    if (sc.expect_kinds[i] == EXPECT_FRAME) {
+      found = find_frame(run.output, run.len, cursor, t);
+    } else {
+      const char* p = strstr(run.output + cursor, t->text);
+      found = p ? p - run.output + t->len : -1;
+    }
+    if (found < 0) {
+      printf("FAIL %s: %s not found: ", path, sc.expect_kinds[i] == EXPECT_FRAME ? "frame" : "output");
+      fflush(stdout);
+      print_escaped(t->text, t->len);
+      ++failures;
+      break;
+    }
+    cursor = found;
+  }
+
+  double values[BUDGET_COUNT];
+  values[BUDGET_BYTES_PER_TICK] = run.len / ticks(run.run_ns);
+  values[BUDGET_SYSCALLS_PER_TICK] = run.syscalls / ticks(run.loop_ns);
+  values[BUDGET_KEY_TO_EXIT_MS] = run.key_to_exit_ns >= 0 ? (double)run.key_to_exit_ns / NSEC_PER_MSEC : 0;
+  for (int i = 0; i < BUDGET_COUNT; i++) {
+    if (sc.budgets[i] >= 0 && values[i] > sc.budgets[i]) {
+      printf("FAIL %s: %s is %.1f, budget is %.1f\n", path, budget_names[i], values[i], sc.budgets[i]);
+      ++failures;
+    }
+  }
+  if (sc.budgets[BUDGET_SYSCALLS_PER_TICK] >= 0 && ! run.traced) {
+    printf("FAIL %s: cannot trace system calls\n", path);
+    ++failures;
+  }
+
+  if (failures) {
+    fprintf(stderr, "Output of %s:\n", path);
+    print_escaped(run.output, run.len);
+  } else {
+    printf("ok   %s", path);
+    for (int i = 0; i < BUDGET_COUNT; i++) {
+      if (sc.budgets[i] >= 0) printf(" %s=%.1f", budget_names[i], values[i]);
+    }
+    putchar('\n');
+  }
+  fflush(stdout);
+  free(run.output);
+  return failures == 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    fprintf(stderr, "Use: %s WAITEXIT SCENARIO..\n", argv[0]);
+    return 1;
+  }
+  int failed = 0;
+  for (int i = 2; i < argc; i++) {
+    if (! check_scenario(argv[1], argv[i])) ++failed;
+  }
+  printf("%i of %i scenarios passed\n", argc - 2 - failed, argc - 2);
+  return failed ? 1 : 0;
+}
@@ -4,6 +4,7 @@
  * Author: Øyvind Stegard <oyvind@stegard.net>
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <ctype.h>
 #include <stdlib.h>
@@ -12,7 +13,38 @@
 #include <errno.h>
 #include <string.h>
 #include <termios.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/random.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <stddef.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <linux/input.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#include "catalog.h"
 
 /* Get terminal width (columns) using ioctl. */
 static unsigned short term_width = 0;
@@ -27,6 +59,81 @@ static unsigned short get_terminal_width() {
   return term_width;
 }
 
+/* Localized messages are looked up in a compiled catalog for the language of
+   LC_ALL, LC_MESSAGES or LANG, named LANGUAGE.cat in WAITEXIT_CATALOG_DIR or
+   CATALOG_DIR. The catalog is mapped into memory as is, so loading it costs
+   no parsing, see catalog.h for the format. */
+#ifndef CATALOG_DIR
+#define CATALOG_DIR "/usr/local/share/waitexit"
+#endif
+
+#define MSG_TEXT(id, text) text,
+static const char* const default_messages[] = { WAITEXIT_MESSAGES(MSG_TEXT) };
+#undef MSG_TEXT
+#define MSG_NAME(id, text) #id,
+static const char* const message_names[] = { WAITEXIT_MESSAGES(MSG_NAME) };
+#undef MSG_NAME
+
+static const char* catalog = NULL;
+
+#define _(id) localized(id)
+static const char* localized(int id) {
+  if (catalog) {
+    const uint32_t offset = ((const uint32_t*)(catalog + sizeof(CatalogHeader)))[id];
+    if (offset != 0) {
+      return catalog + offset;
+    }
+  }
+  return default_messages[id];
+}
+
+/* Maps catalog for the language of the locale environment, if there is one.
+   Messages stay untranslated on any error. */
+static void load_catalog() {
+  const char* locale = getenv("LC_ALL");
+  if (! locale || ! *locale) locale = getenv("LC_MESSAGES");
+  if (! locale || ! *locale) locale = getenv("LANG");
+  if (! locale || ! *locale || strcmp(locale, "C") == 0 || strcmp(locale, "POSIX") == 0) {
+    return;
+  }
+  const char* dir = getenv("WAITEXIT_CATALOG_DIR");
+  char path[PATH_MAX];
+  const int lang_len = strcspn(locale, "_.@");
+  if (snprintf(path, sizeof(path), "%s/%.*s.cat", dir ? dir : CATALOG_DIR, lang_len, locale) >= sizeof(path)) {
+    return;
+  }
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  struct stat st;
+  const size_t table_end = sizeof(CatalogHeader) + MSG_COUNT * sizeof(uint32_t);
+  if (fstat(fd, &st) < 0 || st.st_size < table_end || st.st_size > (1 << 20)) {
+    close(fd);
+    return;
+  }
+  const char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return;
+  }
+  const CatalogHeader* header = (const CatalogHeader*)data;
+  const uint32_t* offsets = (const uint32_t*)(data + sizeof(CatalogHeader));
+  int valid = memcmp(header->magic, CATALOG_MAGIC, 4) == 0
+    && header->count == MSG_COUNT
+    && header->layout == catalog_layout_hash(message_names, MSG_COUNT)
+    // Strings must be within the file and terminated by its end
+    && data[st.st_size - 1] == 0;
+  for (int id = 0; valid && id < MSG_COUNT; id++) {
+    valid = offsets[id] == 0 || (offsets[id] >= table_end && offsets[id] < st.st_size);
+  }
+  if (! valid) {
+    munmap((void*)data, st.st_size);
+    return;
+  }
+  catalog = data;
+}
+
 /* Word wraps and aligns a prefix pluss descriptive text.
    For user friendly help text formatting in resizable terminal. */
 #define FORMATTING_MAX_WIDTH 80
@@ -70,63 +177,289 @@ static void print_aligned(FILE* const out,
   fputs(buf, out);
 }
 
+/* Prints a long option on a line of its own, followed by its description
+   indented to the same column as the short options. */
+static void print_long_option(FILE* const out, const char* option, const char* text) {
+  print_aligned(out, option, "");
+  print_aligned(out, "        ", text);
+}
+
 /* Prints formatted program usage to stderr. */
 static void print_usage(const char* self) {
-  print_aligned(stderr, "", "Prints a countdown in terminal while waiting to exit. When timer reaches zero or any input occurs, the program exits.");
+  print_aligned(stderr, "", _(MSG_ABOUT));
   print_aligned(stderr, "", "");
 
   char* bnbuf = strdup(self);
-  char use_prefix[strlen(bnbuf)+100];
-  sprintf(use_prefix, "Use: %s [opts] N, ", basename(bnbuf));
+  char use_prefix[strlen(bnbuf)+strlen(_(MSG_USAGE))];
+  sprintf(use_prefix, _(MSG_USAGE), basename(bnbuf));
   free(bnbuf);
-  print_aligned(stderr, use_prefix, "where N is number of seconds to wait.");
+  print_aligned(stderr, use_prefix, "");
+  print_aligned(stderr, "", _(MSG_USAGE_N));
 
   print_aligned(stderr, "", "");
-  print_aligned(stderr, "Options:", "");
+  print_aligned(stderr, _(MSG_OPTIONS), "");
   
-  print_aligned(stderr, "-m MSG  ", "Use a custom countdown message template, where '%S' is replaced by number of seconds left.");
-  print_aligned(stderr, "-e CODE ", "Exit with status CODE.");
-  print_aligned(stderr, "-f      ", "Exit with status 0 if user presses a key within the timeout, otherwise exit with non-zero code.");
-  print_aligned(stderr, "-z      ", "Suppress printing of wait time and status code on exit.");
-  print_aligned(stderr, "-s      ", "Be completely silent, do not output anything while waiting or on exit.");
-  print_aligned(stderr, "-h      ", "Show this help.");
-}
-
-#define DEFAULT_MSG_TEMPLATE         "Waiting for %S seconds, press any key to exit.."
-
-/* Prepares message from template, with number of seconds left. */
-static void prepare_message(char* dst, const char* template, const int seconds_left) {
-  const size_t template_len = strlen(template);
-  for (unsigned int i=0; i<template_len; i++) {
-    const char c = template[i];
-    switch (c) {
-    case '\n':
-    case '\r':
-      continue;
-    case '%':
-      if (i<template_len-1 && template[i+1] == 'S') {
-        dst += sprintf(dst, "%d", seconds_left);
-        ++i;
-        continue;
+  print_aligned(stderr, "-m MSG  ", _(MSG_HELP_M));
+  print_aligned(stderr, "-e CODE ", _(MSG_HELP_E));
+  print_aligned(stderr, "-f      ", _(MSG_HELP_F));
+  print_aligned(stderr, "-z      ", _(MSG_HELP_Z));
+  print_aligned(stderr, "-s      ", _(MSG_HELP_S));
+  print_aligned(stderr, "-h      ", _(MSG_HELP_H));
+  print_long_option(stderr, "--message-file PATH", _(MSG_HELP_MESSAGE_FILE));
+  print_long_option(stderr, "--metrics-interval SECS", _(MSG_HELP_METRICS_INTERVAL));
+  print_long_option(stderr, "--splay SECS", _(MSG_HELP_SPLAY));
+  print_long_option(stderr, "--splay-by-host", _(MSG_HELP_SPLAY_BY_HOST));
+  print_long_option(stderr, "--gate DIR", _(MSG_HELP_GATE));
+  print_long_option(stderr, "--gate-slots K", _(MSG_HELP_GATE_SLOTS));
+  print_long_option(stderr, "--repeat", _(MSG_HELP_REPEAT));
+  print_long_option(stderr, "--catch-up", _(MSG_HELP_CATCH_UP));
+  print_long_option(stderr, "--retry MAX", _(MSG_HELP_RETRY));
+  print_long_option(stderr, "--backoff-max SECS", _(MSG_HELP_BACKOFF_MAX));
+  print_long_option(stderr, "--progress SOURCE", _(MSG_HELP_PROGRESS));
+  print_long_option(stderr, "--progress-interval SECS", _(MSG_HELP_PROGRESS_INTERVAL));
+  print_long_option(stderr, "--notify", _(MSG_HELP_NOTIFY));
+  print_long_option(stderr, "--stopwatch", _(MSG_HELP_STOPWATCH));
+  print_long_option(stderr, "--wait-process NAME", _(MSG_HELP_WAIT_PROCESS));
+  print_long_option(stderr, "--budget SECS", _(MSG_HELP_BUDGET));
+  print_long_option(stderr, "--cron EXPR", _(MSG_HELP_CRON));
+  print_long_option(stderr, "--render-thread", _(MSG_HELP_RENDER_THREAD));
+  print_long_option(stderr, "--early-wake PCT", _(MSG_HELP_EARLY_WAKE));
+  print_long_option(stderr, "--input-device PATH", _(MSG_HELP_INPUT_DEVICE));
+  print_long_option(stderr, "--input-keys CODES", _(MSG_HELP_INPUT_KEYS));
+  print_long_option(stderr, "--syslog LABEL", _(MSG_HELP_SYSLOG));
+  print_long_option(stderr, "--syslog-socket PATH", _(MSG_HELP_SYSLOG_SOCKET));
+  print_long_option(stderr, "--dump-fd FD", _(MSG_HELP_DUMP_FD));
+  print_long_option(stderr, "--stats", _(MSG_HELP_STATS));
+  print_long_option(stderr, "--trace-startup", _(MSG_HELP_TRACE_STARTUP));
+  print_long_option(stderr, "--coproc", _(MSG_HELP_COPROC));
+}
+
+#define MAX_RETRIES                  99
+
+#define MAX_GATE_SLOTS               64
+
+#define TEMPLATE_MAX_SIZE            256
+
+#define MAX_INPUT_DEVICES            8
+/* Cron expression "MIN HOUR DAY MONTH WEEKDAY" with each field parsed into a
+   bitset of allowed values. Fields are lists of '*', 'A' or 'A-B', each
+   optionally followed by '/STEP'. */
+typedef struct {
+  unsigned long long minutes;
+  unsigned int hours;
+  unsigned int days;
+  unsigned int months;
+  unsigned int weekdays;
+  int any_day;
+  int any_weekday;
+} CronSpec;
+
+/* Parses one cron field into bits, advancing *p past it.
+   Returns != 0 on success. */
+static int parse_cron_field(const char** p, int min, int max, unsigned long long* bits) {
+  *bits = 0;
+  while (isspace(**p)) ++*p;
+  for (;;) {
+    int from, to, step = 1;
+    char* end;
+    if (**p == '*') {
+      from = min;
+      to = max;
+      ++*p;
+    } else {
+      from = to = strtol(*p, &end, 10);
+      if (end == *p) return 0;
+      *p = end;
+      if (**p == '-') {
+        to = strtol(++*p, &end, 10);
+        if (end == *p) return 0;
+        *p = end;
       }
-    default:
-      *(dst++) = c;
     }
+    if (**p == '/') {
+      step = strtol(++*p, &end, 10);
+      if (end == *p || step < 1) return 0;
+      *p = end;
+    }
+    if (from < min || to > max || from > to) return 0;
+    for (int v = from; v <= to; v += step) *bits |= 1ULL << v;
+    if (**p != ',') break;
+    ++*p;
+  }
+  return **p == 0 || isspace(**p);
+}
+
+/* Parses cron expression, returns != 0 on success. */
+static int parse_cron(const char* expr, CronSpec* cron) {
+  unsigned long long bits[5];
+  static const int ranges[5][2] = { {0, 59}, {0, 23}, {1, 31}, {1, 12}, {0, 7} };
+  for (int i = 0; i < 5; i++) {
+    while (isspace(*expr)) ++expr;
+    cron->any_day = i == 2 ? *expr == '*' : cron->any_day;
+    cron->any_weekday = i == 4 ? *expr == '*' : cron->any_weekday;
+    if (! parse_cron_field(&expr, ranges[i][0], ranges[i][1], &bits[i])) return 0;
+  }
+  while (isspace(*expr)) ++expr;
+  cron->minutes = bits[0];
+  cron->hours = bits[1];
+  cron->days = bits[2];
+  cron->months = bits[3];
+  // Sunday is both 0 and 7
+  cron->weekdays = (bits[4] | bits[4] >> 7) & 0x7f;
+  return *expr == 0;
+}
+
+/* Returns next time after t matching cron spec, or -1 if there is none within
+   the next few years. Each step jumps directly to the next allowed value of
+   the first field which does not match, so no minute by minute search. */
+static time_t next_cron_time(const CronSpec* cron, time_t t) {
+  struct tm tm;
+  localtime_r(&t, &tm);
+  tm.tm_sec = 0;
+  tm.tm_min += 1;
+  tm.tm_isdst = -1;
+  mktime(&tm);
+  for (int i = 0; i < 2000; i++) {
+    if (! (cron->months & 1U << (tm.tm_mon + 1))) {
+      tm.tm_mon += 1;
+      tm.tm_mday = 1;
+      tm.tm_hour = tm.tm_min = 0;
+    } else if (! ((cron->any_day || cron->any_weekday)
+                  ? (cron->days & 1U << tm.tm_mday) && (cron->weekdays & 1U << tm.tm_wday)
+                  : (cron->days & 1U << tm.tm_mday) || (cron->weekdays & 1U << tm.tm_wday))) {
+      tm.tm_mday += 1;
+      tm.tm_hour = tm.tm_min = 0;
+    } else if (! (cron->hours & 1U << tm.tm_hour)) {
+      unsigned int later = cron->hours >> tm.tm_hour;
+      if (later) {
+        tm.tm_hour += __builtin_ctz(later);
+      } else {
+        tm.tm_mday += 1;
+        tm.tm_hour = 0;
+      }
+      tm.tm_min = 0;
+    } else if (! (cron->minutes & 1ULL << tm.tm_min)) {
+      unsigned long long later = cron->minutes >> tm.tm_min;
+      if (later) {
+        tm.tm_min += __builtin_ctzll(later);
+      } else {
+        tm.tm_hour += 1;
+        tm.tm_min = 0;
+      }
+    } else {
+      return mktime(&tm);
+    }
+    tm.tm_isdst = -1;
+    mktime(&tm);
   }
-  *dst = 0;
+  return -1;
 }
 
 typedef struct {
   int countdown;
   unsigned int opts;
   unsigned char exitcode;
-  char template[256];
+  char template[TEMPLATE_MAX_SIZE];
+  const char* message_file;
+  int metrics_interval;
+  int splay;
+  const char* gate_dir;
+  int gate_slots;
+  char** command;
+  CronSpec cron;
+  int retries;
+  int backoff_max;
+  int budget;
+  const char* progress;
+  int progress_interval;
+  int wake_percentile;
+  const char* syslog_label;
+  const char* syslog_socket;
+  const char* input_devices[MAX_INPUT_DEVICES];
+  int input_device_count;
+  // Bitset of key codes accepted from input devices, all if empty
+  unsigned long long input_keys[KEY_CNT / 64];
+  const char* wait_process;
+  int dump_fd;
 } Settings;
 
 #define OPT_SILENT                    0x1
 #define OPT_HELP                      0x2
 #define OPT_SUPPRESS_EXIT_INFO        0x4
 #define OPT_FAIL_NO_USER_INTERACTION  0x8
+#define OPT_COPROC                    0x10
+#define OPT_SPLAY_BY_HOST             0x20
+#define OPT_CUSTOM_MESSAGE            0x40
+#define OPT_STATS                     0x80
+#define OPT_REPEAT                    0x100
+#define OPT_CATCH_UP                  0x200
+#define OPT_CRON                      0x400
+#define OPT_RETRY                     0x800
+#define OPT_NOTIFY                    0x1000
+#define OPT_RENDER_THREAD             0x2000
+#define OPT_TRACE_STARTUP             0x4000
+#define OPT_SYSLOG                    0x8000
+#define OPT_STOPWATCH                 0x10000
+
+/* Values for options which only have a long form. */
+#define LONGOPT_MESSAGE_FILE          256
+#define LONGOPT_METRICS_INTERVAL      257
+#define LONGOPT_COPROC                258
+#define LONGOPT_SPLAY                 259
+#define LONGOPT_SPLAY_BY_HOST         260
+#define LONGOPT_GATE                  261
+#define LONGOPT_GATE_SLOTS            262
+#define LONGOPT_STATS                 263
+#define LONGOPT_REPEAT                264
+#define LONGOPT_CATCH_UP              265
+#define LONGOPT_CRON                  266
+#define LONGOPT_RETRY                 267
+#define LONGOPT_BACKOFF_MAX           268
+#define LONGOPT_BUDGET                269
+#define LONGOPT_PROGRESS              270
+#define LONGOPT_PROGRESS_INTERVAL     271
+#define LONGOPT_NOTIFY                272
+#define LONGOPT_EARLY_WAKE            273
+#define LONGOPT_RENDER_THREAD         274
+#define LONGOPT_TRACE_STARTUP         275
+#define LONGOPT_SYSLOG                276
+#define LONGOPT_SYSLOG_SOCKET         277
+#define LONGOPT_INPUT_DEVICE          278
+#define LONGOPT_INPUT_KEYS            279
+#define LONGOPT_WAIT_PROCESS          280
+#define LONGOPT_DUMP_FD               281
+#define LONGOPT_STOPWATCH             282
+
+static const struct option long_options[] = {
+  { "message-file", required_argument, NULL, LONGOPT_MESSAGE_FILE },
+  { "metrics-interval", required_argument, NULL, LONGOPT_METRICS_INTERVAL },
+  { "coproc", no_argument, NULL, LONGOPT_COPROC },
+  { "splay", required_argument, NULL, LONGOPT_SPLAY },
+  { "splay-by-host", no_argument, NULL, LONGOPT_SPLAY_BY_HOST },
+  { "gate", required_argument, NULL, LONGOPT_GATE },
+  { "gate-slots", required_argument, NULL, LONGOPT_GATE_SLOTS },
+  { "stats", no_argument, NULL, LONGOPT_STATS },
+  { "trace-startup", no_argument, NULL, LONGOPT_TRACE_STARTUP },
+  { "syslog", required_argument, NULL, LONGOPT_SYSLOG },
+  { "syslog-socket", required_argument, NULL, LONGOPT_SYSLOG_SOCKET },
+  { "input-device", required_argument, NULL, LONGOPT_INPUT_DEVICE },
+  { "input-keys", required_argument, NULL, LONGOPT_INPUT_KEYS },
+  { "wait-process", required_argument, NULL, LONGOPT_WAIT_PROCESS },
+  { "dump-fd", required_argument, NULL, LONGOPT_DUMP_FD },
+  { "stopwatch", no_argument, NULL, LONGOPT_STOPWATCH },
+  { "repeat", no_argument, NULL, LONGOPT_REPEAT },
+  { "catch-up", no_argument, NULL, LONGOPT_CATCH_UP },
+  { "cron", required_argument, NULL, LONGOPT_CRON },
+  { "retry", required_argument, NULL, LONGOPT_RETRY },
+  { "backoff-max", required_argument, NULL, LONGOPT_BACKOFF_MAX },
+  { "budget", required_argument, NULL, LONGOPT_BUDGET },
+  { "progress", required_argument, NULL, LONGOPT_PROGRESS },
+  { "progress-interval", required_argument, NULL, LONGOPT_PROGRESS_INTERVAL },
+  { "notify", no_argument, NULL, LONGOPT_NOTIFY },
+  { "early-wake", required_argument, NULL, LONGOPT_EARLY_WAKE },
+  { "render-thread", no_argument, NULL, LONGOPT_RENDER_THREAD },
+  { NULL, 0, NULL, 0 }
+};
 
 /* Parse arguments and populate settings object, returns != 0 on success. */
 static int parse_arguments(int argc, char** argv, Settings* settings) {
@@ -135,11 +468,29 @@ static int parse_arguments(int argc, char** argv, Settings* settings) {
   settings->opts = 0;
   settings->countdown = -1;
   settings->exitcode = 0;
-  strcpy(settings->template, DEFAULT_MSG_TEMPLATE);
+  settings->message_file = NULL;
+  settings->metrics_interval = 5;
+  settings->splay = 0;
+  settings->gate_dir = NULL;
+  settings->gate_slots = 1;
+  settings->command = NULL;
+  settings->retries = 0;
+  settings->backoff_max = 0;
+  settings->budget = 0;
+  settings->progress = NULL;
+  settings->progress_interval = 2;
+  settings->wake_percentile = 0;
+  settings->syslog_label = NULL;
+  settings->syslog_socket = "/dev/log";
+  settings->input_device_count = 0;
+  settings->wait_process = NULL;
+  settings->dump_fd = STDERR_FILENO;
+  memset(settings->input_keys, 0, sizeof(settings->input_keys));
+  snprintf(settings->template, sizeof(settings->template), "%s", _(MSG_TEMPLATE));
 
   opterr = 1;
   
-  while ((c = getopt(argc, argv, "shzfe:m:")) != -1) {
+  while ((c = getopt_long(argc, argv, "shzfe:m:", long_options, NULL)) != -1) {
     switch(c) {
     case 's':
       settings->opts |= OPT_SILENT;
@@ -152,12 +503,160 @@ static int parse_arguments(int argc, char** argv, Settings* settings) {
       settings->exitcode = 0;
       break;
     case 'm':
-      if (strnlen(optarg, 256) >= 256) {
+      if (strnlen(optarg, TEMPLATE_MAX_SIZE) >= TEMPLATE_MAX_SIZE) {
         fprintf(stderr, "Error: message template too big, max size is 255 chars.");
         return 0;
       }
-      strncpy(settings->template, optarg, 255);
-      settings->template[255] = 0;
+      strncpy(settings->template, optarg, TEMPLATE_MAX_SIZE-1);
+      settings->template[TEMPLATE_MAX_SIZE-1] = 0;
+      settings->message_file = NULL;
+      settings->opts |= OPT_CUSTOM_MESSAGE;
+      break;
+    case LONGOPT_MESSAGE_FILE:
+      settings->message_file = optarg;
+      settings->opts |= OPT_CUSTOM_MESSAGE;
+      break;
+    case LONGOPT_METRICS_INTERVAL:
+      if (sscanf(optarg, "%i", &val) != 1 || val < 1) {
+        fprintf(stderr, "Error: --metrics-interval requires a positive integer argument: %s\n", optarg);
+        return 0;
+      }
+      settings->metrics_interval = val;
+      break;
+    case LONGOPT_COPROC:
+      settings->opts |= OPT_COPROC;
+      break;
+    case LONGOPT_SPLAY:
+      if (sscanf(optarg, "%i", &val) != 1 || val < 0) {
+        fprintf(stderr, "Error: --splay requires a non-negative integer argument: %s\n", optarg);
+        return 0;
+      }
+      settings->splay = val;
+      break;
+    case LONGOPT_SPLAY_BY_HOST:
+      settings->opts |= OPT_SPLAY_BY_HOST;
+      break;
+    case LONGOPT_STATS:
+      settings->opts |= OPT_STATS;
+      break;
+    case LONGOPT_TRACE_STARTUP:
+      settings->opts |= OPT_TRACE_STARTUP;
+      break;
+    case LONGOPT_SYSLOG:
+      settings->syslog_label = optarg;
+      settings->opts |= OPT_SYSLOG;
+      break;
+    case LONGOPT_SYSLOG_SOCKET:
+      settings->syslog_socket = optarg;
+      break;
+    case LONGOPT_WAIT_PROCESS:
+      if (! *optarg || strcmp(optarg, "cmdline:") == 0) {
+        fprintf(stderr, "Error: --wait-process requires a process name or cmdline:TEXT argument.\n");
+        return 0;
+      }
+      settings->wait_process = optarg;
+      break;
+    case LONGOPT_STOPWATCH:
+      settings->opts |= OPT_STOPWATCH;
+      break;
+    case LONGOPT_DUMP_FD:
+      if (sscanf(optarg, "%i", &val) != 1 || val < 0) {
+        fprintf(stderr, "Error: --dump-fd requires a file descriptor number: %s\n", optarg);
+        return 0;
+      }
+      settings->dump_fd = val;
+      break;
+    case LONGOPT_INPUT_DEVICE:
+      if (settings->input_device_count == MAX_INPUT_DEVICES) {
+        fprintf(stderr, "Error: at most %i input devices can be watched.\n", MAX_INPUT_DEVICES);
+        return 0;
+      }
+      settings->input_devices[settings->input_device_count++] = optarg;
+      break;
+    case LONGOPT_INPUT_KEYS:
+      for (const char* p = optarg; ; p++) {
+        char* end;
+        long code = strtol(p, &end, 10);
+        if (end == p || code < 0 || code >= KEY_CNT || (*end && *end != ',')) {
+          fprintf(stderr, "Error: --input-keys requires a list of key codes below %i: %s\n", KEY_CNT, optarg);
+          return 0;
+        }
+        settings->input_keys[code / 64] |= 1ULL << (code % 64);
+        p = end;
+        if (! *p) break;
+      }
+      break;
+    case LONGOPT_REPEAT:
+      settings->opts |= OPT_REPEAT;
+      break;
+    case LONGOPT_CATCH_UP:
+      settings->opts |= OPT_CATCH_UP;
+      break;
+    case LONGOPT_RETRY:
+      if (sscanf(optarg, "%i", &val) != 1 || val < 1 || val > MAX_RETRIES) {
+        fprintf(stderr, "Error: --retry requires integer argument between 1 and %i: %s\n", MAX_RETRIES, optarg);
+        return 0;
+      }
+      settings->retries = val;
+      settings->opts |= OPT_RETRY;
+      break;
+    case LONGOPT_BACKOFF_MAX:
+      if (sscanf(optarg, "%i", &val) != 1 || val < 1) {
+        fprintf(stderr, "Error: --backoff-max requires a positive integer argument: %s\n", optarg);
+        return 0;
+      }
+      settings->backoff_max = val;
+      break;
+    case LONGOPT_NOTIFY:
+      settings->opts |= OPT_NOTIFY;
+      break;
+    case LONGOPT_PROGRESS:
+      settings->progress = optarg;
+      break;
+    case LONGOPT_PROGRESS_INTERVAL:
+      if (sscanf(optarg, "%i", &val) != 1 || val < 1) {
+        fprintf(stderr, "Error: --progress-interval requires a positive integer argument: %s\n", optarg);
+        return 0;
+      }
+      settings->progress_interval = val;
+      break;
+    case LONGOPT_RENDER_THREAD:
+      settings->opts |= OPT_RENDER_THREAD;
+      break;
+    case LONGOPT_EARLY_WAKE:
+      if (sscanf(optarg, "%i", &val) != 1 || val < 1 || val > 99) {
+        fprintf(stderr, "Error: --early-wake requires integer argument between 1 and 99: %s\n", optarg);
+        return 0;
+      }
+      settings->wake_percentile = val;
+      break;
+    case LONGOPT_BUDGET:
+      if (sscanf(optarg, "%i", &val) != 1 || val < 1) {
+        fprintf(stderr, "Error: --budget requires a positive integer argument: %s\n", optarg);
+        return 0;
+      }
+      settings->budget = val;
+      break;
+    case LONGOPT_CRON:
+      if (! parse_cron(optarg, &settings->cron)) {
+        fprintf(stderr, "Error: invalid cron expression: %s\n", optarg);
+        return 0;
+      }
+      if (next_cron_time(&settings->cron, time(NULL)) < 0) {
+        fprintf(stderr, "Error: cron expression never matches: %s\n", optarg);
+        return 0;
+      }
+      settings->opts |= OPT_CRON;
+      break;
+    case LONGOPT_GATE:
+      settings->gate_dir = optarg;
+      break;
+    case LONGOPT_GATE_SLOTS:
+      if (sscanf(optarg, "%i", &val) != 1 || val < 1 || val > MAX_GATE_SLOTS) {
+        fprintf(stderr, "Error: --gate-slots requires integer argument between 1 and %i: %s\n", MAX_GATE_SLOTS, optarg);
+        return 0;
+      }
+      settings->gate_slots = val;
       break;
     case 'e':
       if (sscanf(optarg, "%i", &val) != 1) {
@@ -186,104 +685,2644 @@ static int parse_arguments(int argc, char** argv, Settings* settings) {
     }
     settings->countdown = val;
   }
+  if (optind + 1 < argc) {
+    settings->command = &argv[optind + 1];
+  }
+
+  if (! (settings->opts & OPT_CUSTOM_MESSAGE)) {
+    if (settings->gate_dir) {
+      snprintf(settings->template, sizeof(settings->template), "%s", _(MSG_TEMPLATE_GATE));
+    } else if (settings->opts & OPT_REPEAT) {
+      snprintf(settings->template, sizeof(settings->template), "%s", _(MSG_TEMPLATE_REPEAT));
+    } else if (settings->opts & OPT_RETRY) {
+      snprintf(settings->template, sizeof(settings->template), "%s", _(MSG_TEMPLATE_RETRY));
+    } else if (settings->progress) {
+      snprintf(settings->template, sizeof(settings->template), "%s", _(MSG_TEMPLATE_PROGRESS));
+    } else if (settings->opts & OPT_NOTIFY) {
+      snprintf(settings->template, sizeof(settings->template), "%s", _(MSG_TEMPLATE_NOTIFY));
+    } else if (settings->wait_process) {
+      snprintf(settings->template, sizeof(settings->template), "%s", _(MSG_TEMPLATE_WAIT_PROCESS));
+    } else if (settings->opts & OPT_STOPWATCH) {
+      snprintf(settings->template, sizeof(settings->template), "%s", _(MSG_TEMPLATE_STOPWATCH));
+    }
+  }
   
   return 1;
 }
 
-/* Waits at most one second for a character to be read from stdin. 
-   Returns 0 on timeout, or non zero on input while waiting. */
-static int wait_for_one_second_or_input() {
-  fd_set read_stdin_fds;
-  FD_ZERO(&read_stdin_fds);
-  FD_SET(STDIN_FILENO, &read_stdin_fds);
-  
-  struct timeval tv;
-  tv.tv_sec = 1;
-  tv.tv_usec = 0;
+#define NSEC_PER_SEC                  1000000000LL
+
+/* Current time of monotonic clock in nanoseconds. */
+static long long monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Counters for --stats, to measure the cost of many idle instances. Frame
+   counters are atomic, as the render thread updates them while the main
+   thread may print them. */
+static struct {
+  unsigned long wakeups;
+  _Atomic unsigned long frames;
+  _Atomic unsigned long frames_skipped;
+  _Atomic unsigned long bytes_written;
+  _Atomic size_t max_frame_bytes;
+  long long expiry_late_ns;
+  long long expiry_to_exit_ns;
+  _Atomic long long render_ns;
+  long long input_ns;
+  long long input_to_exit_ns;
+  // Lateness of the most recent ticks, for the distribution
+  long long tick_late_ns[1024];
+  unsigned long ticks;
+} stats;
 
-  int retval = select(fileno(stdin)+1, &read_stdin_fds, NULL, NULL, &tv);
-  if (retval) {
-    char devnull[1024];
-    read(fileno(stdin), &devnull, sizeof(devnull));
-    return retval;
+/* Startup phases timed for --trace-startup. Timestamps are always taken, as
+   that is cheap, but only printed when asked for. The time of exec can be
+   passed in WAITEXIT_TRACE_EXEC_NS by the launcher, as CLOCK_MONOTONIC
+   nanoseconds, to include dynamic loading. */
+#define TRACE_EXEC                    0
+#define TRACE_LOADED                  1
+#define TRACE_MAIN                    2
+#define TRACE_CATALOG                 3
+#define TRACE_ARGUMENTS               4
+#define TRACE_PREPARED                5
+#define TRACE_TERMIO                  6
+#define TRACE_FIRST_FRAME             7
+#define TRACE_PHASES                  8
+static const char* const trace_phase_names[] = {
+  "exec", "loaded", "main", "catalog", "arguments", "prepared", "termio", "first_frame" };
+static _Atomic long long startup_trace[TRACE_PHASES];
+
+static void trace_phase(int phase) {
+  if (startup_trace[phase] == 0) {
+    startup_trace[phase] = monotonic_ns();
   }
+}
 
-  return 0;
+__attribute__((constructor)) static void trace_loaded() {
+  trace_phase(TRACE_LOADED);
 }
 
-static struct termios default_term;
+/* Prints time of each startup phase since exec, or since the program was
+   loaded if time of exec is unknown, as a single line of key=value pairs on
+   stderr. Phases not reached are -1. */
+static void print_startup_trace() {
+  const char* exec_ns = getenv("WAITEXIT_TRACE_EXEC_NS");
+  if (exec_ns) {
+    startup_trace[TRACE_EXEC] = strtoll(exec_ns, NULL, 10);
+  }
+  const long long base = startup_trace[TRACE_EXEC] ? startup_trace[TRACE_EXEC] : startup_trace[TRACE_LOADED];
+  fprintf(stderr, "waitexit-startup pid=%i", (int)getpid());
+  for (int i = 0; i < TRACE_PHASES; i++) {
+    fprintf(stderr, " %s_us=%lld", trace_phase_names[i],
+            startup_trace[i] ? (startup_trace[i] - base) / 1000 : -1);
+  }
+  fputc('\n', stderr);
+}
 
-static void reset_termio() {
-  tcsetattr(fileno(stdin), TCSANOW, &default_term);
+static int compare_ll(const void* a, const void* b) {
+  const long long x = *(const long long*)a, y = *(const long long*)b;
+  return (x > y) - (x < y);
 }
 
-static void init_termio() {
-  // Unbuffered standard out
-  setvbuf(stdout, NULL, _IONBF, 0);
+/* Returns the given percentile of up to 1024 samples. */
+static long long percentile(const long long* samples, int count, int pct) {
+  long long sorted[1024];
+  if (count == 0) {
+    return 0;
+  }
+  memcpy(sorted, samples, count * sizeof(*samples));
+  qsort(sorted, count, sizeof(*sorted), compare_ll);
+  return sorted[(count - 1) * pct / 100];
+}
 
-  // Non-canonical non-echoing stdin if tty
-  if (isatty(fileno(stdin))) {
-    tcgetattr(fileno(stdin), &default_term);
-    atexit(reset_termio);
-  
-    struct termios term;
-    tcgetattr(fileno(stdin), &term);
-  
-    term.c_lflag &= ~(ECHO | ICANON);
-    tcsetattr(fileno(stdin), TCSANOW, &term);
+/* Self-calibrating early wake for --early-wake. The lateness of recent timer
+   wakeups is tracked, and timers are armed earlier by a percentile of it,
+   spinning the rest of the way to the tick. */
+#define WAKE_SAMPLES                  32
+#define MAX_WAKE_LEAD_NS              (2 * 1000000LL)
+static struct {
+  int percentile;
+  long long samples[WAKE_SAMPLES];
+  int count;
+  int next;
+  long long lead_ns;
+} wake;
+
+static void record_wake_lateness(long long late_ns) {
+  wake.samples[wake.next] = late_ns;
+  wake.next = (wake.next + 1) % WAKE_SAMPLES;
+  if (wake.count < WAKE_SAMPLES) ++wake.count;
+  wake.lead_ns = percentile(wake.samples, wake.count, wake.percentile);
+  if (wake.lead_ns > MAX_WAKE_LEAD_NS) wake.lead_ns = MAX_WAKE_LEAD_NS;
+}
+
+/* Return values of event handlers and of waiting. */
+#define EVENT_NONE                    0
+#define EVENT_REDRAW                  1
+#define EVENT_EXIT                    2
+
+/* An event source is a file descriptor polled while waiting, with a handler
+   invoked when it becomes readable. */
+typedef int (*EventHandler)(int fd, void* ctx);
+
+#define MAX_EVENT_SOURCES             16
+static struct pollfd event_fds[MAX_EVENT_SOURCES];
+static EventHandler event_handlers[MAX_EVENT_SOURCES];
+static void* event_contexts[MAX_EVENT_SOURCES];
+static int event_sources = 0;
+
+static int add_event_source(int fd, EventHandler handler, void* ctx) {
+  if (event_sources == MAX_EVENT_SOURCES) {
+    return 0;
   }
+  event_fds[event_sources].fd = fd;
+  event_fds[event_sources].events = POLLIN;
+  event_handlers[event_sources] = handler;
+  event_contexts[event_sources] = ctx;
+  ++event_sources;
+  return 1;
 }
 
-int main(int argc, char ** argv) {
+/* What ended the countdown, set by the event handler returning EVENT_EXIT.
+   --repeat, --retry and --stopwatch set their own outcome when done. */
+#define REASON_TIMEOUT                0
+#define REASON_INPUT                  1
+#define REASON_ACQUIRED               2
+#define REASON_COMPLETE               3
+#define REASON_READY                  4
+#define REASON_EXITED                 5
+#define REASON_GONE                   6
+#define REASON_SUCCEEDED              7
+#define REASON_GAVE_UP                8
+#define REASON_ABORTED                9
+#define REASON_STOPPED                10
 
-  Settings settings;
-  if (!parse_arguments(argc, argv, &settings)) {
-    return 1;
+static int countdown_reason = REASON_TIMEOUT;
+
+/* Any input on stdin ends the countdown. The first key pressed is kept for
+   modes where keys have different meanings, or -1 on end of input. */
+static int input_key = -1;
+
+static int on_stdin_input(int fd, void* ctx) {
+  char devnull[1024];
+  ssize_t n = read(fd, &devnull, sizeof(devnull));
+  input_key = n > 0 ? (unsigned char)devnull[0] : -1;
+  stats.input_ns = monotonic_ns();
+  countdown_reason = REASON_INPUT;
+  return EVENT_EXIT;
+}
+
+/* Input devices watched with --input-device, so that a key pressed on a
+   physical keyboard ends the countdown even when the terminal does not have
+   focus. Only key presses are considered, not repeats or releases. Q and Esc
+   are passed on as 'q' and Esc keys, others as a NUL key. */
+static int input_device_fds[MAX_INPUT_DEVICES];
+static int input_device_fd_count = 0;
+
+static int on_input_device_event(int fd, void* ctx) {
+  const unsigned long long* keys = ctx;
+  int any_key = 1;
+  for (int i = 0; i < KEY_CNT / 64; i++) {
+    if (keys[i]) any_key = 0;
+  }
+  struct input_event events[64];
+  ssize_t n;
+  while ((n = read(fd, events, sizeof(events))) > 0) {
+    for (int i = 0; i < n / sizeof(struct input_event); i++) {
+      const struct input_event* ev = &events[i];
+      if (ev->type != EV_KEY || ev->value != 1 || ev->code >= KEY_CNT) continue;
+      if (! any_key && ! (keys[ev->code / 64] & (1ULL << (ev->code % 64)))) continue;
+      input_key = ev->code == KEY_Q ? 'q' : ev->code == KEY_ESC ? 27 : 0;
+      stats.input_ns = monotonic_ns();
+      countdown_reason = REASON_INPUT;
+      return EVENT_EXIT;
+    }
+  }
+  if (n == 0 || errno != EAGAIN) {
+    // Device is gone, stop polling it
+    for (int i = 0; i < event_sources; i++) {
+      if (event_fds[i].fd == fd) event_fds[i].fd = -1;
+    }
   }
+  return EVENT_NONE;
+}
 
-  if (settings.opts & OPT_HELP) {
-    print_usage(argv[0]);
-    return 0;
+static int open_input_devices(const Settings* settings) {
+  for (int i = 0; i < settings->input_device_count; i++) {
+    int fd = open(settings->input_devices[i], O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+      fprintf(stderr, "Error: cannot open input device %s: %s\n", settings->input_devices[i], strerror(errno));
+      return 0;
+    }
+    input_device_fds[input_device_fd_count++] = fd;
+    add_event_source(fd, on_input_device_event, (void*)settings->input_keys);
   }
+  return 1;
+}
 
-  if (settings.countdown < 0) {
-    fprintf(stderr, "Error: number of seconds to wait must be specified.\n");
-    return 1;
+static void close_input_devices() {
+  while (input_device_fd_count > 0) {
+    close(input_device_fds[--input_device_fd_count]);
   }
+}
 
-  init_termio();
+/* Files watched for changes through inotify. The parent directory is watched
+   rather than the file itself, so that files replaced by rename are seen too. */
+typedef void (*FileChangeHandler)(const char* path, void* ctx);
 
-  int seconds = settings.countdown;
-  int exitcode = settings.exitcode;
+typedef struct {
+  char* path;
+  char* name;
+  int wd;
+  FileChangeHandler on_change;
+  void* ctx;
+} FileWatch;
 
-  int seconds_left = seconds;
-  while (seconds_left > 0) {
-    if (! (settings.opts & OPT_SILENT)) {
-      char msg[1024];
-      prepare_message(msg, settings.template, seconds_left);
-      fputs(msg, stdout);
+#define MAX_FILE_WATCHES              16
+static FileWatch file_watches[MAX_FILE_WATCHES];
+static int file_watch_count = 0;
+static int inotify_fd = -1;
+
+static int on_inotify_event(int fd, void* ctx) {
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  int result = EVENT_NONE;
+  ssize_t len;
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    for (char* p = buf; p < buf + len; ) {
+      const struct inotify_event* ev = (const struct inotify_event*)p;
+      for (int i = 0; i < file_watch_count; i++) {
+        FileWatch* w = &file_watches[i];
+        if (w->wd == ev->wd && ev->len > 0 && strcmp(w->name, ev->name) == 0) {
+          w->on_change(w->path, w->ctx);
+          result = EVENT_REDRAW;
+        }
+      }
+      p += sizeof(struct inotify_event) + ev->len;
     }
-    if (wait_for_one_second_or_input()) {
-      break;
+  }
+  return result;
+}
+
+/* Stops all file watches. Contexts of watches are owned by the caller. */
+static void release_file_watches() {
+  for (int i = 0; i < file_watch_count; i++) {
+    free(file_watches[i].path);
+    free(file_watches[i].name);
+  }
+  file_watch_count = 0;
+  if (inotify_fd >= 0) {
+    close(inotify_fd);
+    inotify_fd = -1;
+  }
+}
+
+/* Starts watching path for changes, returns != 0 on success. */
+static int watch_file(const char* path, FileChangeHandler on_change, void* ctx) {
+  if (file_watch_count == MAX_FILE_WATCHES) {
+    return 0;
+  }
+  if (inotify_fd < 0) {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0 || ! add_event_source(inotify_fd, on_inotify_event, NULL)) {
+      return 0;
     }
-    
-    seconds_left = seconds_left - 1;
-    
-    if (! (settings.opts & OPT_SILENT)) {
-      fprintf(stdout, "\r\033[K");
+  }
+  char* dirbuf = strdup(path);
+  char* namebuf = strdup(path);
+  int wd = inotify_add_watch(inotify_fd, dirname(dirbuf), IN_CLOSE_WRITE | IN_MOVED_TO);
+  free(dirbuf);
+  if (wd < 0) {
+    free(namebuf);
+    return 0;
+  }
+  FileWatch* w = &file_watches[file_watch_count++];
+  w->path = strdup(path);
+  w->name = strdup(basename(namebuf));
+  w->wd = wd;
+  w->on_change = on_change;
+  w->ctx = ctx;
+  free(namebuf);
+  return 1;
+}
+
+/* Reads at most max-1 bytes of file into dst and zero terminates it.
+   Returns number of bytes read, or -1 on failure. */
+static ssize_t read_small_file(const char* path, char* dst, size_t max) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  ssize_t n = read(fd, dst, max-1);
+  close(fd);
+  if (n < 0) {
+    return -1;
+  }
+  dst[n] = 0;
+  return n;
+}
+
+#define TEMPLATE_MAX_SEGMENTS        64
+
+#define SEGMENT_LITERAL              0
+#define SEGMENT_SECONDS              1
+#define SEGMENT_FILE                 2
+#define SEGMENT_METRIC               3
+#define SEGMENT_SPLAY                4
+#define SEGMENT_QUEUE                5
+#define SEGMENT_ATTEMPT              6
+#define SEGMENT_PERCENT              7
+#define SEGMENT_STATUS               8
+#define SEGMENT_PROCESSES            9
+#define SEGMENT_ELAPSED              10
+#define SEGMENT_LAP                  11
+
+typedef struct {
+  unsigned char kind;
+  unsigned short offset;
+  unsigned short len;
+} TemplateSegment;
+
+/* A message template compiled into literal and placeholder segments, so that
+   rendering a frame is only a sequence of copies. */
+typedef struct {
+  char literals[TEMPLATE_MAX_SIZE];
+  TemplateSegment segments[TEMPLATE_MAX_SEGMENTS];
+  int nsegments;
+} CompiledTemplate;
+
+static TemplateSegment* add_segment(CompiledTemplate* ct, unsigned char kind) {
+  if (ct->nsegments == TEMPLATE_MAX_SEGMENTS) {
+    return NULL;
+  }
+  TemplateSegment* seg = &ct->segments[ct->nsegments++];
+  seg->kind = kind;
+  seg->offset = 0;
+  seg->len = 0;
+  return seg;
+}
+
+/* Deadline of the current countdown, monotonic time in nanoseconds. Event
+   handlers may move it. */
+static long long countdown_deadline = 0;
+
+/* Random offset added to the deadline of the current countdown. */
+static long long splay_ns = 0;
+
+/* Number of waiters ahead in the concurrency gate queue. */
+static int gate_ahead = 0;
+
+/* Number of the last attempt made by --retry. */
+static int retry_attempt = 0;
+
+/* Percent done of --progress source. */
+static int progress_percent = 0;
+
+/* Last STATUS= text sent by a --notify service. */
+#define NOTIFY_STATUS_MAX_SIZE       128
+static char notify_status[NOTIFY_STATUS_MAX_SIZE];
+static unsigned char notify_status_len = 0;
+
+/* Number of processes matching --wait-process. */
+static int process_count = 0;
+
+/* Whole seconds elapsed and laps recorded by --stopwatch. */
+#define MAX_LAPS                     1024
+static int stopwatch_elapsed = 0;
+static long long lap_ns[MAX_LAPS];
+static int lap_count = 0;
+
+/* Formats non-negative integer into dst, returns number of chars written. */
+static size_t format_uint(char* dst, unsigned int value) {
+  char digits[10];
+  size_t n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+  for (size_t i = 0; i < n; i++) dst[i] = digits[n-1-i];
+  return n;
+}
+
+/* Values of %{file:PATH} placeholders. Files are only read when inotify
+   reports a change, and the cached value is used when rendering. */
+#define FILE_VALUE_MAX_SIZE          128
+#define MAX_FILE_VALUES              8
+
+typedef struct {
+  char* path;
+  char value[FILE_VALUE_MAX_SIZE];
+  unsigned short len;
+} FileValue;
+
+static FileValue file_values[MAX_FILE_VALUES];
+static int file_value_count = 0;
+
+/* Reads file into cached value, dropping line breaks. A missing or
+   unreadable file gives an empty value. */
+static void load_file_value(FileValue* fv) {
+  char buf[FILE_VALUE_MAX_SIZE];
+  ssize_t n = read_small_file(fv->path, buf, sizeof(buf));
+  fv->len = 0;
+  for (ssize_t i = 0; i < n; i++) {
+    if (buf[i] != '\n' && buf[i] != '\r') fv->value[fv->len++] = buf[i];
+  }
+}
+
+static void on_file_value_change(const char* path, void* ctx) {
+  load_file_value((FileValue*)ctx);
+}
+
+static void release_file_values() {
+  for (int i = 0; i < file_value_count; i++) {
+    free(file_values[i].path);
+  }
+  file_value_count = 0;
+}
+
+/* Finds or registers file value for path, returns index or -1 if no more
+   file values can be registered. */
+static int file_value_index(const char* path, size_t path_len) {
+  for (int i = 0; i < file_value_count; i++) {
+    if (strlen(file_values[i].path) == path_len && strncmp(file_values[i].path, path, path_len) == 0) {
+      return i;
     }
   }
-  if (seconds_left == 0 && (settings.opts & OPT_FAIL_NO_USER_INTERACTION)) {
-    exitcode = 1;
+  if (file_value_count == MAX_FILE_VALUES) {
+    return -1;
+  }
+  FileValue* fv = &file_values[file_value_count];
+  fv->path = strndup(path, path_len);
+  if (! watch_file(fv->path, on_file_value_change, fv)) {
+    fprintf(stderr, "Warning: cannot watch file for changes: %s\n", fv->path);
+  }
+  load_file_value(fv);
+  return file_value_count++;
+}
+
+/* System metric placeholders. Files in /proc are opened once, the first time
+   a metric from them is used, and then re-read with pread at the metrics
+   refresh interval. Values are kept as text, ready to be copied. */
+#define METRIC_LOAD1                 0
+#define METRIC_LOAD5                 1
+#define METRIC_LOAD15                2
+#define METRIC_RUNNABLE              3
+#define METRIC_MEMFREE               4
+#define METRIC_MEMAVAIL              5
+#define METRIC_COUNT                 6
+
+#define METRIC_VALUE_MAX_SIZE        24
+
+static const char* const metric_names[METRIC_COUNT] = {
+  "load1", "load5", "load15", "runnable", "memfree", "memavail"
+};
+static char metric_values[METRIC_COUNT][METRIC_VALUE_MAX_SIZE];
+static unsigned char metric_lens[METRIC_COUNT];
+
+#define METRIC_SOURCE_LOADAVG        0
+#define METRIC_SOURCE_MEMINFO        1
+
+static const char* const metric_source_paths[] = { "/proc/loadavg", "/proc/meminfo" };
+static int metric_source_fds[] = { -1, -1 };
+
+static void set_metric(int metric, const char* value, size_t len) {
+  if (len >= METRIC_VALUE_MAX_SIZE) len = METRIC_VALUE_MAX_SIZE - 1;
+  memcpy(metric_values[metric], value, len);
+  metric_lens[metric] = len;
+}
+
+/* Parses "0.52 0.58 0.59 2/1234 5678" as found in /proc/loadavg. */
+static void parse_loadavg(const char* buf, size_t len) {
+  const char* end = buf + len;
+  const char* field = buf;
+  for (int metric = METRIC_LOAD1; metric <= METRIC_RUNNABLE && field < end; metric++) {
+    const char* stop = field;
+    while (stop < end && *stop != ' ' && *stop != '/') ++stop;
+    set_metric(metric, field, stop - field);
+    field = stop + 1;
+  }
+}
+
+/* Picks MemFree and MemAvailable from /proc/meminfo, reported in MiB. */
+static void parse_meminfo(const char* buf, size_t len) {
+  const char* end = buf + len;
+  for (const char* line = buf; line < end; ) {
+    int metric = -1;
+    if (end - line > 8 && memcmp(line, "MemFree:", 8) == 0) {
+      metric = METRIC_MEMFREE;
+    } else if (end - line > 13 && memcmp(line, "MemAvailable:", 13) == 0) {
+      metric = METRIC_MEMAVAIL;
+    }
+    const char* p = line;
+    while (p < end && *p != '\n') ++p;
+    if (metric >= 0) {
+      unsigned long kb = 0;
+      for (const char* d = line; d < p; d++) {
+        if (*d >= '0' && *d <= '9') kb = kb * 10 + (*d - '0');
+      }
+      char num[METRIC_VALUE_MAX_SIZE];
+      set_metric(metric, num, format_uint(num, kb / 1024));
+      if (metric == METRIC_MEMAVAIL) return;
+    }
+    line = p + 1;
   }
-  if (! (settings.opts & OPT_SILENT)) {
-    if (settings.opts & OPT_SUPPRESS_EXIT_INFO) {
-      fprintf(stdout, "\r\033[K\r");
+}
+
+/* Re-reads all metric sources in use. */
+static void refresh_metrics() {
+  char buf[4096];
+  for (int source = 0; source < 2; source++) {
+    if (metric_source_fds[source] < 0) continue;
+    ssize_t n = pread(metric_source_fds[source], buf, sizeof(buf), 0);
+    if (n <= 0) continue;
+    if (source == METRIC_SOURCE_LOADAVG) {
+      parse_loadavg(buf, n);
     } else {
-      fprintf(stdout, "\r\033[KExit %i after %i seconds.\n", exitcode, seconds-seconds_left);
+      parse_meminfo(buf, n);
     }
   }
+}
 
-  
-  return exitcode;
+static int metrics_in_use() {
+  return metric_source_fds[METRIC_SOURCE_LOADAVG] >= 0 || metric_source_fds[METRIC_SOURCE_MEMINFO] >= 0;
+}
+
+/* Returns metric for placeholder name, opening its source on first use,
+   or -1 if name is not a metric. */
+static int metric_index(const char* name, size_t name_len) {
+  for (int metric = 0; metric < METRIC_COUNT; metric++) {
+    if (strlen(metric_names[metric]) == name_len && strncmp(metric_names[metric], name, name_len) == 0) {
+      int source = metric >= METRIC_MEMFREE ? METRIC_SOURCE_MEMINFO : METRIC_SOURCE_LOADAVG;
+      if (metric_source_fds[source] < 0) {
+        metric_source_fds[source] = open(metric_source_paths[source], O_RDONLY | O_CLOEXEC);
+        refresh_metrics();
+      }
+      return metric;
+    }
+  }
+  return -1;
+}
+
+/* Compiles a %{name} or %{name:arg} placeholder, returns 0 if the
+   placeholder is unknown and should be kept as literal text. */
+static int compile_placeholder(CompiledTemplate* ct, const char* name, size_t name_len,
+                               const char* arg, size_t arg_len) {
+  TemplateSegment* seg;
+  if (name_len == 4 && strncmp(name, "file", 4) == 0 && arg_len > 0) {
+    int index = file_value_index(arg, arg_len);
+    if (index >= 0 && (seg = add_segment(ct, SEGMENT_FILE))) {
+      seg->offset = index;
+    }
+    return 1;
+  }
+  if (name_len == 5 && strncmp(name, "splay", 5) == 0) {
+    add_segment(ct, SEGMENT_SPLAY);
+    return 1;
+  }
+  if (name_len == 5 && strncmp(name, "queue", 5) == 0) {
+    add_segment(ct, SEGMENT_QUEUE);
+    return 1;
+  }
+  if (name_len == 7 && strncmp(name, "attempt", 7) == 0) {
+    add_segment(ct, SEGMENT_ATTEMPT);
+    return 1;
+  }
+  if (name_len == 7 && strncmp(name, "percent", 7) == 0) {
+    add_segment(ct, SEGMENT_PERCENT);
+    return 1;
+  }
+  if (name_len == 6 && strncmp(name, "status", 6) == 0) {
+    add_segment(ct, SEGMENT_STATUS);
+    return 1;
+  }
+  if (name_len == 9 && strncmp(name, "processes", 9) == 0) {
+    add_segment(ct, SEGMENT_PROCESSES);
+    return 1;
+  }
+  if (name_len == 7 && strncmp(name, "elapsed", 7) == 0) {
+    add_segment(ct, SEGMENT_ELAPSED);
+    return 1;
+  }
+  if (name_len == 3 && strncmp(name, "lap", 3) == 0) {
+    add_segment(ct, SEGMENT_LAP);
+    return 1;
+  }
+  int metric = metric_index(name, name_len);
+  if (metric >= 0) {
+    if ((seg = add_segment(ct, SEGMENT_METRIC))) {
+      seg->offset = metric;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+/* Compiles template into segments. Line breaks are dropped, and the template
+   is silently truncated if it would exceed the segment limit. */
+static void compile_template(CompiledTemplate* ct, const char* template) {
+  size_t used = 0;
+  TemplateSegment* literal = NULL;
+  ct->nsegments = 0;
+  for (const char* p = template; *p && used < TEMPLATE_MAX_SIZE; p++) {
+    switch (*p) {
+    case '\n':
+    case '\r':
+      continue;
+    case '%':
+      if (p[1] == 'S') {
+        if (! add_segment(ct, SEGMENT_SECONDS)) return;
+        literal = NULL;
+        ++p;
+        continue;
+      }
+      if (p[1] == '{') {
+        const char* name = p + 2;
+        const char* close = strchr(name, '}');
+        if (close) {
+          const char* colon = memchr(name, ':', close - name);
+          const char* name_end = colon ? colon : close;
+          const char* arg = colon ? colon + 1 : close;
+          if (compile_placeholder(ct, name, name_end - name, arg, close - arg)) {
+            literal = NULL;
+            p = close;
+            continue;
+          }
+        }
+      }
+    default:
+      if (! literal) {
+        if (! (literal = add_segment(ct, SEGMENT_LITERAL))) return;
+        literal->offset = used;
+      }
+      ct->literals[used++] = *p;
+      ++literal->len;
+    }
+  }
+}
+
+/* Values of placeholders for one frame, copied from the state of the main
+   thread, so that frames can be rendered on the render thread too. */
+typedef struct {
+  int seconds_left;
+  int splay;
+  int queue;
+  int attempt;
+  int percent;
+  int processes;
+  int elapsed;
+  int lap;
+  unsigned char status_len;
+  char status[NOTIFY_STATUS_MAX_SIZE];
+  unsigned short file_lens[MAX_FILE_VALUES];
+  char files[MAX_FILE_VALUES][FILE_VALUE_MAX_SIZE];
+  unsigned char metric_lens[METRIC_COUNT];
+  char metrics[METRIC_COUNT][METRIC_VALUE_MAX_SIZE];
+} FrameValues;
+
+static void snapshot_frame_values(FrameValues* v, const int seconds_left) {
+  v->seconds_left = seconds_left;
+  v->splay = splay_ns / NSEC_PER_SEC;
+  v->queue = gate_ahead;
+  v->attempt = retry_attempt;
+  v->percent = progress_percent;
+  v->processes = process_count;
+  v->elapsed = stopwatch_elapsed;
+  v->lap = lap_count + 1;
+  v->status_len = notify_status_len;
+  memcpy(v->status, notify_status, notify_status_len);
+  for (int i = 0; i < file_value_count; i++) {
+    v->file_lens[i] = file_values[i].len;
+    memcpy(v->files[i], file_values[i].value, file_values[i].len);
+  }
+  memcpy(v->metric_lens, metric_lens, sizeof(metric_lens));
+  memcpy(v->metrics, metric_values, sizeof(metric_values));
+}
+
+/* Renders compiled template into dst with placeholder values. The output is
+   truncated to fit within cap bytes, including terminating zero. Returns
+   length of rendered message. */
+static size_t render_template(char* dst, size_t cap, const CompiledTemplate* ct, const FrameValues* v) {
+  char* p = dst;
+  char* const end = dst + cap - 1;
+  for (int i = 0; i < ct->nsegments; i++) {
+    const TemplateSegment* seg = &ct->segments[i];
+    switch (seg->kind) {
+    case SEGMENT_LITERAL: {
+      size_t len = seg->len < end - p ? seg->len : end - p;
+      memcpy(p, ct->literals + seg->offset, len);
+      p += len;
+      break;
+    }
+    case SEGMENT_SECONDS:
+      if (end - p >= 10) p += format_uint(p, v->seconds_left);
+      break;
+    case SEGMENT_FILE: {
+      size_t len = v->file_lens[seg->offset] < end - p ? v->file_lens[seg->offset] : end - p;
+      memcpy(p, v->files[seg->offset], len);
+      p += len;
+      break;
+    }
+    case SEGMENT_SPLAY:
+      if (end - p >= 10) p += format_uint(p, v->splay);
+      break;
+    case SEGMENT_QUEUE:
+      if (end - p >= 10) p += format_uint(p, v->queue);
+      break;
+    case SEGMENT_ATTEMPT:
+      if (end - p >= 10) p += format_uint(p, v->attempt);
+      break;
+    case SEGMENT_PERCENT:
+      if (end - p >= 10) p += format_uint(p, v->percent);
+      break;
+    case SEGMENT_PROCESSES:
+      if (end - p >= 10) p += format_uint(p, v->processes);
+      break;
+    case SEGMENT_ELAPSED:
+      if (end - p >= 10) p += format_uint(p, v->elapsed);
+      break;
+    case SEGMENT_LAP:
+      if (end - p >= 10) p += format_uint(p, v->lap);
+      break;
+    case SEGMENT_STATUS: {
+      size_t len = v->status_len < end - p ? v->status_len : end - p;
+      memcpy(p, v->status, len);
+      p += len;
+      break;
+    }
+    case SEGMENT_METRIC: {
+      size_t len = v->metric_lens[seg->offset] < end - p ? v->metric_lens[seg->offset] : end - p;
+      memcpy(p, v->metrics[seg->offset], len);
+      p += len;
+      break;
+    }
+    }
+  }
+  *p = 0;
+  return p - dst;
+}
+
+/* Renderers specialized at build time for known templates, generated by
+   mkrender. The generic renderer is used for other templates. */
+typedef size_t (*TemplateRenderer)(char* dst, size_t cap, const CompiledTemplate* ct, const FrameValues* v);
+
+typedef struct {
+  const char* template;
+  TemplateRenderer render;
+} SpecializedRenderer;
+
+#include "renderers.h"
+
+static TemplateRenderer find_renderer(const char* template) {
+  for (const SpecializedRenderer* r = specialized_renderers; r->template; r++) {
+    if (strcmp(r->template, template) == 0) {
+      return r->render;
+    }
+  }
+  return render_template;
+}
+
+static CompiledTemplate message;
+static TemplateRenderer message_renderer = render_template;
+
+/* Recompiles message template when message file changes. An unreadable file
+   keeps the current message. */
+static void on_message_file_change(const char* path, void* ctx) {
+  char buf[TEMPLATE_MAX_SIZE];
+  if (read_small_file(path, buf, sizeof(buf)) >= 0) {
+    compile_template(&message, buf);
+    message_renderer = find_renderer(buf);
+  }
+}
+
+/* Concurrency gate: a directory holding one lock file per slot, and one queue
+   file per waiter named by arrival time. Slots and queue places are held with
+   flock(2), which the kernel releases when a holder exits or crashes, so a
+   waiter finding an unlocked queue file removes it as stale. The directory is
+   watched for closed and removed files, which is when slots may free up.
+   Free slots are found by briefly locking them, which would hide them from
+   a waiter probing at the same time, and releasing a lock is not seen by
+   the watch, so probing is serialized with a lock on the probe file. */
+static int gate_dir_fd = -1;
+static int gate_probe_fd = -1;
+static int gate_inotify_fd = -1;
+static int gate_queue_fd = -1;
+static char gate_queue_name[64];
+static int gate_slot_fds[MAX_GATE_SLOTS];
+static int gate_slots = 0;
+static int gate_held_slot = -1;
+
+/* Counts live waiters queued ahead of this one, removing stale queue files. */
+static int count_gate_queue_ahead() {
+  DIR* dir = fdopendir(dup(gate_dir_fd));
+  if (! dir) {
+    return 0;
+  }
+  int ahead = 0;
+  struct dirent* entry;
+  while ((entry = readdir(dir))) {
+    if (strncmp(entry->d_name, "queue.", 6) != 0 || strcmp(entry->d_name, gate_queue_name) >= 0) {
+      continue;
+    }
+    int fd = openat(gate_dir_fd, entry->d_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+      unlinkat(gate_dir_fd, entry->d_name, 0);
+    } else {
+      ++ahead;
+    }
+    close(fd);
+  }
+  closedir(dir);
+  return ahead;
+}
+
+/* Takes a free slot if no more waiters are queued ahead than there are free
+   slots. Returns != 0 when a slot is held. */
+static int update_gate() {
+  gate_ahead = count_gate_queue_ahead();
+  if (gate_ahead >= gate_slots) {
+    // Could not be admitted even if all slots were free
+    return 0;
+  }
+  int free_slots = 0;
+  int taken = -1;
+  flock(gate_probe_fd, LOCK_EX);
+  for (int i = 0; i < gate_slots; i++) {
+    if (flock(gate_slot_fds[i], LOCK_EX | LOCK_NB) == 0) {
+      ++free_slots;
+      if (taken < 0) {
+        taken = i;
+      } else {
+        flock(gate_slot_fds[i], LOCK_UN);
+      }
+    }
+  }
+  if (taken >= 0 && gate_ahead >= free_slots) {
+    flock(gate_slot_fds[taken], LOCK_UN);
+    taken = -1;
+  }
+  flock(gate_probe_fd, LOCK_UN);
+  if (taken < 0) {
+    return 0;
+  }
+  gate_held_slot = taken;
+  unlinkat(gate_dir_fd, gate_queue_name, 0);
+  close(gate_queue_fd);
+  gate_queue_fd = -1;
+  gate_ahead = 0;
+  return 1;
+}
+
+static int on_gate_event(int fd, void* ctx) {
+  char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  while (read(fd, buf, sizeof(buf)) > 0);
+  if (gate_held_slot < 0 && update_gate()) {
+    countdown_reason = REASON_ACQUIRED;
+    return EVENT_EXIT;
+  }
+  return EVENT_REDRAW;
+}
+
+/* Opens gate directory and enters the queue, returns != 0 on success. */
+static int open_gate(const char* path, int slots) {
+  mkdir(path, 0777);
+  gate_dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (gate_dir_fd < 0) {
+    return 0;
+  }
+  gate_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (gate_inotify_fd < 0 || inotify_add_watch(gate_inotify_fd, path, IN_CLOSE_WRITE | IN_DELETE) < 0) {
+    return 0;
+  }
+  add_event_source(gate_inotify_fd, on_gate_event, NULL);
+
+  if ((gate_probe_fd = openat(gate_dir_fd, "probe", O_RDONLY | O_CREAT | O_CLOEXEC, 0666)) < 0) {
+    return 0;
+  }
+  gate_slots = slots;
+  for (int i = 0; i < slots; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "slot.%i", i);
+    if ((gate_slot_fds[i] = openat(gate_dir_fd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0666)) < 0) {
+      return 0;
+    }
+  }
+
+  // The queue file is created and locked under a temporary name, and only
+  // then linked into place, so that other waiters never see it unlocked and
+  // remove it as stale
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  snprintf(gate_queue_name, sizeof(gate_queue_name), "queue.%020lld.%09ld.%010d",
+           (long long)now.tv_sec, now.tv_nsec, (int)getpid());
+  char tmp_name[sizeof(gate_queue_name)];
+  snprintf(tmp_name, sizeof(tmp_name), "tmp.%s", gate_queue_name + 6);
+  gate_queue_fd = openat(gate_dir_fd, tmp_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (gate_queue_fd < 0 || flock(gate_queue_fd, LOCK_EX) != 0) {
+    if (gate_queue_fd >= 0) unlinkat(gate_dir_fd, tmp_name, 0);
+    return 0;
+  }
+  const int linked = linkat(gate_dir_fd, tmp_name, gate_dir_fd, gate_queue_name, 0) == 0;
+  unlinkat(gate_dir_fd, tmp_name, 0);
+  return linked;
+}
+
+/* Leaves the gate. A held slot stays locked, and is inherited across exec. */
+static void close_gate() {
+  if (gate_queue_fd >= 0) {
+    unlinkat(gate_dir_fd, gate_queue_name, 0);
+    close(gate_queue_fd);
+    gate_queue_fd = -1;
+  }
+  for (int i = 0; i < gate_slots; i++) {
+    if (i == gate_held_slot) {
+      fcntl(gate_slot_fds[i], F_SETFD, 0);
+    } else if (gate_slot_fds[i] >= 0) {
+      close(gate_slot_fds[i]);
+    }
+  }
+  gate_slots = 0;
+  if (gate_probe_fd >= 0) {
+    close(gate_probe_fd);
+    gate_probe_fd = -1;
+  }
+  if (gate_inotify_fd >= 0) {
+    close(gate_inotify_fd);
+    gate_inotify_fd = -1;
+  }
+  if (gate_dir_fd >= 0) {
+    close(gate_dir_fd);
+    gate_dir_fd = -1;
+  }
+}
+
+/* Calls handlers of event sources found ready by the last poll, returns the
+   strongest of their results. */
+static int dispatch_events() {
+  int result = EVENT_NONE;
+  for (int i = 0; i < event_sources; i++) {
+    if (event_fds[i].revents) {
+      int r = event_handlers[i](event_fds[i].fd, event_contexts[i]);
+      if (r > result) result = r;
+    }
+  }
+  return result;
+}
+
+/* Waits until tick deadline (monotonic ns) for any event.
+   Returns EVENT_NONE on timeout, EVENT_EXIT on input while waiting, or
+   EVENT_REDRAW if displayed message needs to be updated before deadline. */
+static int wait_for_one_second_or_input(const long long tick_deadline) {
+  for (;;) {
+    const long long now = monotonic_ns();
+    const long long remaining = tick_deadline - now;
+    if (remaining <= 0) {
+      stats.tick_late_ns[stats.ticks++ % 1024] = -remaining;
+      return EVENT_NONE;
+    }
+    const long long timeout = remaining - wake.lead_ns;
+    if (timeout <= 0) {
+      sched_yield();
+      continue;
+    }
+    struct timespec ts = { timeout / NSEC_PER_SEC, timeout % NSEC_PER_SEC };
+    int retval = ppoll(event_fds, event_sources, &ts, NULL);
+    ++stats.wakeups;
+    if (retval == 0 && wake.percentile) {
+      record_wake_lateness(monotonic_ns() - (now + timeout));
+    }
+    if (retval <= 0) {
+      continue;
+    }
+    int result = dispatch_events();
+    if (result != EVENT_NONE) {
+      return result;
+    }
+  }
+}
+
+/* Handles events which are ready right now, without waiting. */
+static int poll_events_now() {
+  struct timespec ts = { 0, 0 };
+  return ppoll(event_fds, event_sources, &ts, NULL) > 0 ? dispatch_events() : EVENT_NONE;
+}
+
+/* Terminal used for countdown display and key presses. This is stdin and
+   stdout, except in coprocess mode where those are the control pipes. */
+static int term_in = STDIN_FILENO;
+static FILE* term_out = NULL;
+
+static struct termios default_term;
+
+static void reset_termio() {
+  tcsetattr(term_in, TCSANOW, &default_term);
+}
+
+static void set_raw_termio() {
+  struct termios term = default_term;
+  term.c_lflag &= ~(ECHO | ICANON);
+  tcsetattr(term_in, TCSANOW, &term);
+}
+
+static void init_termio() {
+  // Unbuffered terminal out
+  setvbuf(term_out, NULL, _IONBF, 0);
+
+  // Non-canonical non-echoing terminal in if tty
+  if (isatty(term_in)) {
+    tcgetattr(term_in, &default_term);
+    atexit(reset_termio);
+    set_raw_termio();
+  }
+}
+
+/* Wall clock time of the next cron match, and a timer which is cancelled when
+   the wall clock is set, so the monotonic deadline can be recomputed. */
+static time_t cron_fire_time = 0;
+static int cron_timer_fd = -1;
+
+/* Monotonic time N seconds from the start when N is given with --cron, which
+   the countdown never goes past, or 0. */
+static long long cron_limit = 0;
+
+/* Converts wall clock time to monotonic deadline in nanoseconds. */
+static long long wall_to_monotonic(time_t t) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return monotonic_ns() + (t - now.tv_sec) * NSEC_PER_SEC - now.tv_nsec;
+}
+
+/* Overall time budget as monotonic time in nanoseconds, or 0 if there is
+   none. It is inherited from the environment and may be tightened with
+   --budget. All countdowns are clamped to it, and it is exported to commands
+   run, so nested waits respect the outer limit. */
+#define DEADLINE_ENV                  "WAITEXIT_DEADLINE"
+
+static long long budget_deadline = 0;
+
+static long long clamp_to_budget(long long deadline) {
+  return budget_deadline && deadline > budget_deadline ? budget_deadline : deadline;
+}
+
+static int budget_expired() {
+  return budget_deadline && monotonic_ns() >= budget_deadline;
+}
+
+/* Parses seconds since the epoch with optional fraction into nanoseconds,
+   returns 0 if invalid. */
+static long long parse_wall_deadline(const char* value) {
+  char* end;
+  long long seconds = strtoll(value, &end, 10);
+  if (end == value || seconds <= 0) {
+    return 0;
+  }
+  long long ns = 0;
+  if (*end == '.') {
+    long long scale = NSEC_PER_SEC / 10;
+    for (++end; isdigit(*end); ++end, scale /= 10) {
+      ns += (*end - '0') * scale;
+    }
+  }
+  return *end ? 0 : seconds * NSEC_PER_SEC + ns;
+}
+
+/* Tightens budget to end at most seconds from now. */
+static void tighten_budget(int seconds) {
+  const long long own = monotonic_ns() + seconds * NSEC_PER_SEC;
+  if (! budget_deadline || own < budget_deadline) {
+    budget_deadline = own;
+  }
+}
+
+static void init_budget(const Settings* settings) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  const long long wall_now = now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+
+  long long wall_deadline = 0;
+  const char* inherited = getenv(DEADLINE_ENV);
+  if (inherited && *inherited && ! (wall_deadline = parse_wall_deadline(inherited))) {
+    fprintf(stderr, "Warning: ignoring invalid %s: %s\n", DEADLINE_ENV, inherited);
+  }
+  if (settings->budget > 0) {
+    long long own = wall_now + settings->budget * NSEC_PER_SEC;
+    if (! wall_deadline || own < wall_deadline) wall_deadline = own;
+  }
+  if (! wall_deadline) {
+    return;
+  }
+
+  budget_deadline = monotonic_ns() + (wall_deadline - wall_now);
+  char value[32];
+  snprintf(value, sizeof(value), "%lld.%09lld", wall_deadline / NSEC_PER_SEC, wall_deadline % NSEC_PER_SEC);
+  setenv(DEADLINE_ENV, value, 1);
+}
+
+static void arm_cron_timer() {
+  struct itimerspec its = { { 0, 0 }, { cron_fire_time + 366 * 24 * 3600, 0 } };
+  timerfd_settime(cron_timer_fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+}
+
+static int on_clock_change(int fd, void* ctx) {
+  unsigned long long expirations;
+  read(fd, &expirations, sizeof(expirations));
+  long long deadline = wall_to_monotonic(cron_fire_time) + splay_ns;
+  if (cron_limit && deadline > cron_limit) {
+    deadline = cron_limit;
+  }
+  countdown_deadline = clamp_to_budget(deadline);
+  arm_cron_timer();
+  return EVENT_REDRAW;
+}
+
+/* Finds next cron match and returns it as a monotonic deadline, watching for
+   changes of the wall clock from now on. */
+static long long start_cron_deadline(const CronSpec* cron) {
+  cron_fire_time = next_cron_time(cron, time(NULL));
+  if (cron_fire_time < 0) {
+    return monotonic_ns();
+  }
+  if (cron_timer_fd < 0) {
+    cron_timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (cron_timer_fd >= 0) {
+      add_event_source(cron_timer_fd, on_clock_change, NULL);
+    }
+  }
+  if (cron_timer_fd >= 0) {
+    arm_cron_timer();
+  }
+  return wall_to_monotonic(cron_fire_time);
+}
+
+/* ETA mode: progress as "DONE TOTAL" or "DONE/TOTAL" is sampled from a file,
+   or from a file descriptor given as fd:N, every --progress-interval
+   seconds. The rate of progress is smoothed with an exponentially weighted
+   moving average, and the countdown deadline moved to the estimated time of
+   completion. A file is re-read from the start at each sample, while for a
+   pipe the last complete line received is used. */
+#define PROGRESS_EWMA_WEIGHT          0.3
+
+static const char* progress_path = NULL;
+static int progress_fd = -1;
+static char progress_partial[128];
+static size_t progress_partial_len = 0;
+static char progress_line[128] = "";
+static double progress_rate = 0;
+static double progress_last_done = -1;
+static long long progress_last_ns = 0;
+
+/* Reads latest progress values, returns != 0 if they are valid. */
+static int read_progress(double* done, double* total) {
+  char buf[4096];
+  const char* text = buf;
+  struct stat st;
+  if (progress_path) {
+    if (read_small_file(progress_path, buf, sizeof(buf)) < 0) return 0;
+  } else if (fstat(progress_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    ssize_t n = pread(progress_fd, buf, sizeof(buf) - 1, 0);
+    if (n < 0) return 0;
+    buf[n] = 0;
+  } else {
+    ssize_t n;
+    while ((n = read(progress_fd, buf, sizeof(buf))) > 0) {
+      for (ssize_t i = 0; i < n; i++) {
+        if (buf[i] == '\n') {
+          memcpy(progress_line, progress_partial, progress_partial_len);
+          progress_line[progress_partial_len] = 0;
+          progress_partial_len = 0;
+        } else if (progress_partial_len < sizeof(progress_partial) - 1) {
+          progress_partial[progress_partial_len++] = buf[i];
+        }
+      }
+    }
+    text = progress_line;
+  }
+  return sscanf(text, "%lf%*[ /]%lf", done, total) == 2 && *total > 0;
+}
+
+/* Samples progress and moves the countdown deadline to the estimated time of
+   completion, but never past the latest deadline, nor before the next sample
+   is due. Returns != 0 when done. */
+static int sample_progress(long long now, long long next_sample, long long latest) {
+  double done, total;
+  if (! read_progress(&done, &total)) {
+    return 0;
+  }
+  if (done >= total) {
+    progress_percent = 100;
+    return 1;
+  }
+  progress_percent = 100 * done / total;
+  if (progress_last_done >= 0 && now > progress_last_ns) {
+    double rate = (done - progress_last_done) / (now - progress_last_ns);
+    progress_rate = progress_rate > 0 ? PROGRESS_EWMA_WEIGHT * rate + (1 - PROGRESS_EWMA_WEIGHT) * progress_rate : rate;
+  }
+  progress_last_done = done;
+  progress_last_ns = now;
+  if (progress_rate > 0) {
+    double eta = (total - done) / progress_rate;
+    long long estimate = eta < latest - now ? now + (long long)eta : latest;
+    if (estimate < next_sample + NSEC_PER_SEC) estimate = next_sample + NSEC_PER_SEC;
+    countdown_deadline = clamp_to_budget(estimate < latest ? estimate : latest);
+  }
+  return 0;
+}
+
+static int open_progress(const char* source) {
+  int fd;
+  progress_rate = 0;
+  progress_last_done = -1;
+  progress_percent = 0;
+  if (sscanf(source, "fd:%i", &fd) == 1) {
+    progress_path = NULL;
+    progress_fd = fd;
+    progress_partial_len = 0;
+    progress_line[0] = 0;
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0;
+  }
+  progress_path = source;
+  return 1;
+}
+
+/* State dump on SIGUSR1, received through a signalfd so that it is handled
+   in the event loop like any other event. The dump is a single line of
+   key=value pairs written to --dump-fd, and neither redraws the message nor
+   moves the deadline. SIGUSR1 stays blocked while waitexit runs, and is
+   unblocked again for commands run. */
+static int signal_fd = -1;
+static long long countdown_start = 0;
+static sigset_t default_sigmask;
+
+static int on_dump_signal(int fd, void* ctx) {
+  const Settings* settings = ctx;
+  struct signalfd_siginfo si;
+  int dumps = 0;
+  while (read(fd, &si, sizeof(si)) == sizeof(si)) {
+    ++dumps;
+  }
+  if (dumps == 0) {
+    return EVENT_NONE;
+  }
+  const long long now = monotonic_ns();
+  const int samples = stats.ticks < 1024 ? stats.ticks : 1024;
+  char buf[1024];
+  int len = snprintf(buf, sizeof(buf),
+                     "waitexit-state pid=%i elapsed_ms=%lld remaining_ms=%lld splay_s=%lld "
+                     "queue=%i attempt=%i percent=%i processes=%i "
+                     "wakeups=%lu frames=%lu frames_skipped=%lu ticks=%lu "
+                     "tick_late_p50_us=%lld tick_late_p99_us=%lld tick_late_max_us=%lld wake_lead_us=%lld\n",
+                     (int)getpid(), (now - countdown_start) / 1000000, (countdown_deadline - now) / 1000000,
+                     splay_ns / NSEC_PER_SEC, gate_ahead, retry_attempt, progress_percent, process_count,
+                     stats.wakeups, stats.frames, stats.frames_skipped, stats.ticks,
+                     percentile(stats.tick_late_ns, samples, 50) / 1000,
+                     percentile(stats.tick_late_ns, samples, 99) / 1000,
+                     percentile(stats.tick_late_ns, samples, 100) / 1000, wake.lead_ns / 1000);
+  write(settings->dump_fd, buf, len < sizeof(buf) ? len : sizeof(buf) - 1);
+  return EVENT_NONE;
+}
+
+static void open_signal_fd() {
+  if (signal_fd >= 0) {
+    return;
+  }
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  sigprocmask(SIG_BLOCK, &mask, &default_sigmask);
+  signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+/* Restores signal mask before running a command. */
+static void restore_sigmask() {
+  if (signal_fd >= 0) {
+    sigprocmask(SIG_SETMASK, &default_sigmask, NULL);
+  }
+}
+
+/* Service readiness: COMMAND is started with NOTIFY_SOCKET naming a datagram
+   socket of ours, and sd_notify(3) messages sent to it are handled while
+   waiting. READY=1 ends the countdown, and STATUS= text is kept for the
+   %{status} placeholder. Messages are only accepted from the service and its
+   descendants, as told by the sender credentials passed with each message.
+   The service is watched through a pidfd, so that it exiting before being
+   ready ends the countdown too. */
+static int notify_fd = -1;
+static int notify_pidfd = -1;
+static pid_t notify_pid = -1;
+static int notify_exit_status = 0;
+
+/* Returns parent of pid from /proc, or 0 if it cannot be read. */
+static pid_t parent_pid(pid_t pid) {
+  char path[32];
+  char buf[512];
+  snprintf(path, sizeof(path), "/proc/%i/stat", (int)pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) {
+    return 0;
+  }
+  buf[n] = 0;
+  // The command name may contain anything, so fields are found after its end
+  char* comm_end = strrchr(buf, ')');
+  int ppid;
+  return comm_end && sscanf(comm_end + 1, " %*c %i", &ppid) == 1 ? ppid : 0;
+}
+
+/* Returns != 0 if pid is the service or one of its descendants. */
+static int is_notify_sender(pid_t pid) {
+  for (int depth = 0; pid > 1 && depth < 64; depth++) {
+    if (pid == notify_pid) {
+      return 1;
+    }
+    pid = parent_pid(pid);
+  }
+  return 0;
+}
+
+static int on_notify_message(int fd, void* ctx) {
+  char buf[4096];
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(struct ucred))];
+  } control;
+  struct iovec iov = { buf, sizeof(buf) - 1 };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf };
+  ssize_t n;
+  int result = EVENT_NONE;
+  for (;;) {
+    msg.msg_controllen = sizeof(control.buf);
+    if ((n = recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) <= 0) {
+      break;
+    }
+    // Only messages from the service are accepted, as anyone may send to
+    // the socket
+    const struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (! cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_CREDENTIALS
+        || ! is_notify_sender(((const struct ucred*)CMSG_DATA(cmsg))->pid)) {
+      continue;
+    }
+    buf[n] = 0;
+    for (char* line = buf; line && *line; ) {
+      char* next = strchr(line, '\n');
+      if (next) *(next++) = 0;
+      if (strcmp(line, "READY=1") == 0) {
+        countdown_reason = REASON_READY;
+        result = EVENT_EXIT;
+      } else if (strncmp(line, "STATUS=", 7) == 0) {
+        size_t len = strnlen(line + 7, NOTIFY_STATUS_MAX_SIZE);
+        memcpy(notify_status, line + 7, len);
+        notify_status_len = len;
+        if (result == EVENT_NONE) result = EVENT_REDRAW;
+      }
+      line = next;
+    }
+  }
+  return result;
+}
+
+static int on_notify_service_exit(int fd, void* ctx) {
+  int status;
+  if (waitpid(notify_pid, &status, WNOHANG) != notify_pid) {
+    return EVENT_NONE;
+  }
+  notify_exit_status = WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+  close(notify_pidfd);
+  notify_pidfd = -1;
+  for (int i = 0; i < event_sources; i++) {
+    if (event_fds[i].fd == fd) event_fds[i].fd = -1;
+  }
+  if (countdown_reason != REASON_READY) {
+    countdown_reason = REASON_EXITED;
+  }
+  return EVENT_EXIT;
+}
+
+/* Creates notification socket and starts the service, returns != 0 on
+   success. */
+static int start_notify_service(char** command) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  // Abstract socket address, which needs no cleanup
+  int len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "waitexit/notify/%i", (int)getpid());
+  notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  const int one = 1;
+  if (notify_fd < 0 || setsockopt(notify_fd, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one)) < 0
+      || bind(notify_fd, (struct sockaddr*)&addr, offsetof(struct sockaddr_un, sun_path) + 1 + len) < 0) {
+    return 0;
+  }
+  add_event_source(notify_fd, on_notify_message, NULL);
+
+  char socket_name[sizeof(addr.sun_path) + 1];
+  snprintf(socket_name, sizeof(socket_name), "@%s", addr.sun_path + 1);
+  setenv("NOTIFY_SOCKET", socket_name, 1);
+  notify_pid = fork();
+  if (notify_pid == 0) {
+    int devnull = open("/dev/null", O_RDONLY);
+    if (devnull > STDIN_FILENO) {
+      dup2(devnull, STDIN_FILENO);
+      close(devnull);
+    }
+    restore_sigmask();
+    execvp(command[0], command);
+    fprintf(stderr, "Error: cannot execute %s: %s\n", command[0], strerror(errno));
+    _exit(127);
+  }
+  unsetenv("NOTIFY_SOCKET");
+  if (notify_pid < 0) {
+    return 0;
+  }
+  notify_pidfd = syscall(SYS_pidfd_open, notify_pid, 0);
+  if (notify_pidfd >= 0) {
+    add_event_source(notify_pidfd, on_notify_service_exit, NULL);
+  }
+  return 1;
+}
+
+static void stop_notify() {
+  if (notify_pidfd >= 0) {
+    close(notify_pidfd);
+    notify_pidfd = -1;
+  }
+  if (notify_fd >= 0) {
+    close(notify_fd);
+    notify_fd = -1;
+  }
+}
+
+/* Process wait for --wait-process, which ends when no process matching a name
+   or command line remains. /proc is listed with large getdents64 batches,
+   and what is known about each PID is cached, so that a scan reads only
+   new PIDs and matching ones, the latter to see if they are zombies. The
+   cmdline file of a matching PID is only read again when it has called exec,
+   as told by the command name and start of code in stat changing. Cached
+   PIDs not seen in a scan are dropped, so a PID reused between scans may be
+   missed until then.
+
+   A PID not matching may start matching by calling exec. When privileged,
+   exits and execs are followed through the proc connector, so that such a
+   PID is checked again right away, and the countdown ends right away when
+   the last process exits. Otherwise, each PID not matching is only checked
+   again every PROCESS_RECHECK_SCANS scans, spread over scans by PID, so
+   that scanning many processes stays cheap, at the cost of noticing such an
+   exec up to that many seconds late. waitexit itself and its ancestors,
+   whose command line may well hold the pattern, are never counted. */
+#define MAX_ANCESTORS                 64
+#define PROCESS_RECHECK_SCANS         16
+
+typedef struct {
+  int pid;
+  int match;
+  unsigned long long exe;
+} ProcessEntry;
+
+static struct {
+  const char* name;
+  const char* cmdline;
+  int proc_fd;
+  int connector_fd;
+  // Open addressing hash tables of PIDs, swapped for every scan
+  ProcessEntry* table;
+  ProcessEntry* next_table;
+  unsigned int size;
+  unsigned int count;
+  unsigned int scans;
+  int ancestors[MAX_ANCESTORS];
+  int ancestor_count;
+} processes = { .proc_fd = -1, .connector_fd = -1 };
+
+static ProcessEntry* find_process_entry(ProcessEntry* table, unsigned int size, int pid) {
+  unsigned int i = ((unsigned int)pid * 2654435761u) & (size - 1);
+  while (table[i].pid != 0 && table[i].pid != pid) {
+    i = (i + 1) & (size - 1);
+  }
+  return &table[i];
+}
+
+/* Returns != 0 for waitexit itself and its ancestors. */
+static int is_own_process(int pid) {
+  for (int i = 0; i < processes.ancestor_count; i++) {
+    if (processes.ancestors[i] == pid) return 1;
+  }
+  return 0;
+}
+
+/* Finds out whether process matches, filling entry. The cmdline file is only
+   read if what was cached for the PID is from before an exec. */
+static void check_process(const char* pid_name, const ProcessEntry* cached, ProcessEntry* entry) {
+  char path[64];
+  char buf[4096];
+  entry->match = 0;
+  snprintf(path, sizeof(path), "%s/stat", pid_name);
+  int fd = openat(processes.proc_fd, path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
+  }
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) {
+    return;
+  }
+  buf[n] = 0;
+  // stat is "PID (COMM) STATE ...", where COMM is truncated to 15 chars, and
+  // the start of code is the 26th field
+  char* comm = strchr(buf, '(');
+  char* comm_end = strrchr(buf, ')');
+  if (! comm || ! comm_end || comm_end[1] != ' ' || comm_end[2] == 'Z') {
+    return;
+  }
+  *comm_end = 0;
+  unsigned long long exe = 14695981039346656037ULL;
+  for (const char* c = comm + 1; *c; c++) {
+    exe = (exe ^ (unsigned char)*c) * 1099511628211ULL;
+  }
+  const char* field = comm_end + 2;
+  for (int i = 3; i < 26 && field; i++) {
+    field = strchr(field, ' ');
+    if (field) ++field;
+  }
+  entry->exe = exe ^ (field ? strtoull(field, NULL, 10) : 0);
+  if (processes.name) {
+    entry->match = strncmp(comm + 1, processes.name, 15) == 0;
+    return;
+  }
+  if (cached && cached->pid == entry->pid && cached->exe == entry->exe) {
+    entry->match = cached->match;
+    return;
+  }
+  snprintf(path, sizeof(path), "%s/cmdline", pid_name);
+  if ((fd = openat(processes.proc_fd, path, O_RDONLY | O_CLOEXEC)) < 0) {
+    return;
+  }
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) {
+    return;
+  }
+  buf[n] = 0;
+  for (ssize_t i = 0; i < n; i++) {
+    if (buf[i] == 0) buf[i] = ' ';
+  }
+  entry->match = strstr(buf, processes.cmdline) != NULL;
+}
+
+/* Doubles size of PID tables, keeping what is known about PIDs both from the
+   last scan and from the one in progress. Returns != 0 on success. */
+static int grow_process_tables() {
+  const unsigned int size = processes.size * 2;
+  ProcessEntry* table = calloc(size, sizeof(ProcessEntry));
+  ProcessEntry* next_table = calloc(size, sizeof(ProcessEntry));
+  if (! table || ! next_table) {
+    free(table);
+    free(next_table);
+    return 0;
+  }
+  for (unsigned int i = 0; i < processes.size; i++) {
+    if (processes.table[i].pid) *find_process_entry(table, size, processes.table[i].pid) = processes.table[i];
+    if (processes.next_table[i].pid) *find_process_entry(table, size, processes.next_table[i].pid) = processes.next_table[i];
+  }
+  free(processes.table);
+  free(processes.next_table);
+  processes.table = table;
+  processes.next_table = next_table;
+  processes.size = size;
+  return 1;
+}
+
+/* Scans /proc, returns number of matching processes or -1 on error. */
+static int scan_processes() {
+  char buf[65536];
+  unsigned int next_count = 0;
+  int matches = 0;
+  memset(processes.next_table, 0, processes.size * sizeof(ProcessEntry));
+  ++processes.scans;
+  lseek(processes.proc_fd, 0, SEEK_SET);
+  long n;
+  while ((n = syscall(SYS_getdents64, processes.proc_fd, buf, sizeof(buf))) > 0) {
+    for (long off = 0; off < n; ) {
+      // struct linux_dirent64: ino, off, reclen, type, name
+      const unsigned short reclen = *(unsigned short*)(buf + off + 16);
+      const char* name = buf + off + 19;
+      off += reclen;
+      if (*name < '1' || *name > '9') continue;
+      const int pid = atoi(name);
+      if (is_own_process(pid)) continue;
+      if (next_count * 2 >= processes.size) {
+        return grow_process_tables() ? scan_processes() : -1;
+      }
+      ProcessEntry* cached = find_process_entry(processes.table, processes.size, pid);
+      ProcessEntry* entry = find_process_entry(processes.next_table, processes.size, pid);
+      entry->pid = pid;
+      if (cached->pid == pid && cached->match == 0
+          && (processes.connector_fd >= 0 || (pid + processes.scans) % PROCESS_RECHECK_SCANS != 0)) {
+        *entry = *cached;
+      } else {
+        check_process(name, cached, entry);
+      }
+      matches += entry->match;
+      ++next_count;
+    }
+  }
+  if (n < 0) {
+    return -1;
+  }
+  ProcessEntry* table = processes.table;
+  processes.table = processes.next_table;
+  processes.next_table = table;
+  processes.count = next_count;
+  process_count = matches;
+  return matches;
+}
+
+/* Rescans when a matching process has exited, and checks known processes
+   again when they call exec, according to the connector. */
+static int on_proc_event(int fd, void* ctx) {
+  char buf[4096] __attribute__((aligned(NLMSG_ALIGNTO)));
+  ssize_t n;
+  int rescan = 0;
+  int redraw = 0;
+  while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+    for (struct nlmsghdr* nl = (struct nlmsghdr*)buf; NLMSG_OK(nl, n); nl = NLMSG_NEXT(nl, n)) {
+      const struct cn_msg* cn = NLMSG_DATA(nl);
+      const struct proc_event* ev = (const struct proc_event*)cn->data;
+      if (ev->what == PROC_EVENT_EXEC) {
+        ProcessEntry* entry = find_process_entry(processes.table, processes.size, ev->event_data.exec.process_tgid);
+        if (entry->pid == 0 || is_own_process(entry->pid)) {
+          continue;
+        }
+        char pid_name[16];
+        snprintf(pid_name, sizeof(pid_name), "%i", entry->pid);
+        const int was = entry->match;
+        check_process(pid_name, NULL, entry);
+        process_count += entry->match - was;
+        redraw |= entry->match != was;
+        rescan |= was && ! entry->match;
+        continue;
+      }
+      if (ev->what != PROC_EVENT_EXIT || ev->event_data.exit.process_pid != ev->event_data.exit.process_tgid) {
+        continue;
+      }
+      const ProcessEntry* entry = find_process_entry(processes.table, processes.size, ev->event_data.exit.process_pid);
+      rescan |= entry->match;
+    }
+  }
+  if (! rescan) {
+    return redraw ? EVENT_REDRAW : EVENT_NONE;
+  }
+  if (scan_processes() == 0) {
+    countdown_reason = REASON_GONE;
+    return EVENT_EXIT;
+  }
+  return EVENT_REDRAW;
+}
+
+/* Subscribes to process events, which requires CAP_NET_ADMIN. */
+static void open_proc_connector() {
+  int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+  struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = CN_IDX_PROC };
+  if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    if (fd >= 0) close(fd);
+    return;
+  }
+  struct __attribute__((packed)) {
+    struct nlmsghdr nl;
+    struct cn_msg cn;
+    enum proc_cn_mcast_op op;
+  } msg = {
+    .nl = { .nlmsg_len = sizeof(msg), .nlmsg_type = NLMSG_DONE, .nlmsg_pid = getpid() },
+    .cn = { .id = { .idx = CN_IDX_PROC, .val = CN_VAL_PROC }, .len = sizeof(enum proc_cn_mcast_op) },
+    .op = PROC_CN_MCAST_LISTEN
+  };
+  if (send(fd, &msg, sizeof(msg), 0) < 0) {
+    close(fd);
+    return;
+  }
+  processes.connector_fd = fd;
+  add_event_source(fd, on_proc_event, NULL);
+}
+
+static int open_process_wait(const char* pattern) {
+  processes.name = strncmp(pattern, "cmdline:", 8) == 0 ? NULL : pattern;
+  processes.cmdline = processes.name ? NULL : pattern + 8;
+  processes.size = 1024;
+  processes.table = calloc(processes.size, sizeof(ProcessEntry));
+  processes.next_table = calloc(processes.size, sizeof(ProcessEntry));
+  processes.proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (! processes.table || ! processes.next_table || processes.proc_fd < 0) {
+    return 0;
+  }
+  processes.ancestor_count = 0;
+  for (pid_t pid = getpid(); pid > 0 && processes.ancestor_count < MAX_ANCESTORS; pid = parent_pid(pid)) {
+    processes.ancestors[processes.ancestor_count++] = pid;
+  }
+  open_proc_connector();
+  return scan_processes() >= 0;
+}
+
+static void close_process_wait() {
+  if (processes.connector_fd >= 0) {
+    close(processes.connector_fd);
+    processes.connector_fd = -1;
+  }
+  if (processes.proc_fd >= 0) {
+    close(processes.proc_fd);
+    processes.proc_fd = -1;
+  }
+  free(processes.table);
+  free(processes.next_table);
+  processes.table = processes.next_table = NULL;
+}
+
+/* Loads message template and registers event sources for a countdown.
+   Returns != 0 on success. */
+static int prepare_countdown(Settings* settings) {
+  wake.percentile = settings->wake_percentile;
+  if (settings->message_file) {
+    char buf[TEMPLATE_MAX_SIZE+1];
+    ssize_t n = read_small_file(settings->message_file, buf, sizeof(buf));
+    if (n < 0) {
+      fprintf(stderr, "Error: cannot read message file %s: %s\n", settings->message_file, strerror(errno));
+      return 0;
+    }
+    if (n >= TEMPLATE_MAX_SIZE) {
+      fprintf(stderr, "Error: message file too big, max size is 255 chars: %s\n", settings->message_file);
+      return 0;
+    }
+    strcpy(settings->template, buf);
+  }
+  compile_template(&message, settings->template);
+  message_renderer = find_renderer(settings->template);
+
+  add_event_source(term_in, on_stdin_input, NULL);
+  open_signal_fd();
+  if (signal_fd >= 0) {
+    add_event_source(signal_fd, on_dump_signal, settings);
+  }
+  if (settings->gate_dir && ! open_gate(settings->gate_dir, settings->gate_slots)) {
+    fprintf(stderr, "Error: cannot open gate directory %s: %s\n", settings->gate_dir, strerror(errno));
+    close_gate();
+    return 0;
+  }
+  if (! open_input_devices(settings)) {
+    close_input_devices();
+    return 0;
+  }
+  if ((settings->opts & OPT_NOTIFY) && ! start_notify_service(settings->command)) {
+    fprintf(stderr, "Error: cannot start %s: %s\n", settings->command[0], strerror(errno));
+    stop_notify();
+    return 0;
+  }
+  if (settings->wait_process && ! open_process_wait(settings->wait_process)) {
+    fprintf(stderr, "Error: cannot scan processes: %s\n", strerror(errno));
+    close_process_wait();
+    return 0;
+  }
+  if (settings->progress && ! open_progress(settings->progress)) {
+    fprintf(stderr, "Error: cannot use progress source %s: %s\n", settings->progress, strerror(errno));
+    return 0;
+  }
+  if (settings->message_file && ! (settings->opts & OPT_SILENT)) {
+    if (! watch_file(settings->message_file, on_message_file_change, NULL)) {
+      fprintf(stderr, "Warning: cannot watch message file for changes: %s\n", settings->message_file);
+    }
+  }
+  return 1;
+}
+
+/* Releases event sources and watches registered for a countdown. */
+static void release_countdown() {
+  close_gate();
+  close_process_wait();
+  close_input_devices();
+  stop_notify();
+  if (cron_timer_fd >= 0) {
+    close(cron_timer_fd);
+    cron_timer_fd = -1;
+  }
+  release_file_watches();
+  release_file_values();
+  event_sources = 0;
+}
+
+typedef struct {
+  int exitcode;
+  int elapsed;
+  int reason;
+} CountdownResult;
+
+static const char* const reason_names[] = {
+  "timeout", "input", "acquired", "complete", "ready", "exited", "gone", "succeeded", "gave-up", "aborted", "stopped"
+};
+
+/* Sends outcome as a single syslog datagram of key=value pairs, like
+   '<14>waitexit[PID]: label="LABEL" reason=timeout elapsed=5 exitcode=0'.
+   The socket is non-blocking, and a record which cannot be sent right away
+   is dropped rather than delaying exit. */
+static void send_syslog_record(const Settings* settings, int exitcode, int elapsed, int reason) {
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(settings->syslog_socket) >= sizeof(addr.sun_path)) {
+    return;
+  }
+  strcpy(addr.sun_path, settings->syslog_socket);
+
+  char record[512];
+  char* p = record;
+  char* const end = record + sizeof(record) - 64;
+  p += sprintf(p, "<%i>waitexit[%i]: label=\"", LOG_USER | (exitcode == 0 ? LOG_INFO : LOG_NOTICE), (int)getpid());
+  for (const char* l = settings->syslog_label; *l && p < end; l++) {
+    if (*l == '"' || *l == '\\') *(p++) = '\\';
+    *(p++) = *l;
+  }
+  p += sprintf(p, "\" reason=%s elapsed=%i exitcode=%i", reason_names[reason], elapsed, exitcode);
+
+  int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd >= 0) {
+    sendto(fd, record, p - record, MSG_DONTWAIT | MSG_NOSIGNAL, (struct sockaddr*)&addr, sizeof(addr));
+    close(fd);
+  }
+}
+
+/* FNV-1a hash of host name, stable across runs on the same host. */
+static unsigned long long host_hash() {
+  char name[256] = "";
+  gethostname(name, sizeof(name) - 1);
+  unsigned long long hash = 14695981039346656037ULL;
+  for (const char* p = name; *p; p++) {
+    hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static unsigned long long random_u64() {
+  unsigned long long r;
+  if (getrandom(&r, sizeof(r), GRND_NONBLOCK) != sizeof(r)) {
+    r = monotonic_ns() ^ ((unsigned long long)getpid() << 32);
+  }
+  return r;
+}
+
+/* Picks splay offset in whole seconds, between zero and the configured
+   number of seconds, returned as nanoseconds. */
+static long long compute_splay(const Settings* settings) {
+  if (settings->splay == 0) {
+    return 0;
+  }
+  unsigned long long r = (settings->opts & OPT_SPLAY_BY_HOST) ? host_hash() : random_u64();
+  return (long long)(r % (settings->splay + 1ULL)) * NSEC_PER_SEC;
+}
+
+/* Last frame shown by the main thread, so that unchanged frames can be
+   skipped. */
+#define FRAME_MAX_SIZE                1024
+static char last_frame[FRAME_MAX_SIZE];
+static size_t last_frame_len = 0;
+
+/* Renders message into msg as a frame which clears the line first, returns
+   its length. */
+static size_t render_frame(char* msg, const CompiledTemplate* ct, TemplateRenderer renderer, const FrameValues* v) {
+  memcpy(msg, "\r\033[K", 4);
+  const long long render_start = monotonic_ns();
+  const size_t len = 4 + renderer(msg + 4, FRAME_MAX_SIZE - 4, ct, v);
+  atomic_fetch_add_explicit(&stats.render_ns, monotonic_ns() - render_start, memory_order_relaxed);
+  return len;
+}
+
+/* Writes frame with a single write, unless it is the same as last. */
+static void write_frame(const char* msg, size_t len, char* last, size_t* last_len) {
+  if (len == *last_len && memcmp(msg, last, len) == 0) {
+    atomic_fetch_add_explicit(&stats.frames_skipped, 1, memory_order_relaxed);
+    return;
+  }
+  memcpy(last, msg, len);
+  *last_len = len;
+  write(fileno(term_out), msg, len);
+  trace_phase(TRACE_FIRST_FRAME);
+  atomic_fetch_add_explicit(&stats.frames, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stats.bytes_written, len, memory_order_relaxed);
+  size_t max = atomic_load_explicit(&stats.max_frame_bytes, memory_order_relaxed);
+  while (len > max && ! atomic_compare_exchange_weak_explicit(&stats.max_frame_bytes, &max, len,
+                                                              memory_order_relaxed, memory_order_relaxed));
+}
+
+/* Optional render thread for --render-thread, which renders and writes
+   frames so that a slow terminal never delays handling of key presses. The
+   main thread only publishes the template and placeholder values of a frame,
+   in a lock-free single-producer/single-consumer triple buffer: the producer
+   fills its back slot and swaps it into the middle slot, and the consumer
+   swaps the middle slot for its front slot when it is marked fresh. Only the
+   latest frame is ever rendered, older ones are dropped.
+
+   The last request carries the text shown after clearing the frame, after
+   which the thread exits. When a key ends the countdown the thread is
+   waited for at most RENDER_EXIT_WAIT_NS, as it may be blocked writing to a
+   terminal which does not keep up, and left behind after that, so the
+   channel is shared by both threads and freed by the one done with it
+   last. */
+#define FRAME_FRESH                   4
+#define RENDER_EXIT_WAIT_NS           (NSEC_PER_SEC / 10)
+#define EXIT_TEXT_MAX_SIZE            256
+
+typedef struct {
+  FrameValues values;
+  CompiledTemplate template;
+  TemplateRenderer renderer;
+  int last;
+  size_t text_len;
+  char text[EXIT_TEXT_MAX_SIZE];
+} FrameRequest;
+
+typedef struct {
+  FrameRequest requests[3];
+  _Atomic unsigned int middle;
+  unsigned int back;
+  unsigned int front;
+  _Atomic int refs;
+  int wake_fd;
+  pthread_t thread;
+  // Owned by the render thread
+  char last_frame[FRAME_MAX_SIZE];
+  size_t last_frame_len;
+} RenderChannel;
+
+static RenderChannel* render = NULL;
+
+static void release_render_channel(RenderChannel* ch) {
+  if (atomic_fetch_sub(&ch->refs, 1) == 1) {
+    close(ch->wake_fd);
+    free(ch);
+  }
+}
+
+static void* render_thread_main(void* arg) {
+  RenderChannel* ch = arg;
+  char msg[FRAME_MAX_SIZE];
+  for (int last = 0; ! last; ) {
+    uint64_t n;
+    read(ch->wake_fd, &n, sizeof(n));
+    if (! (atomic_load_explicit(&ch->middle, memory_order_relaxed) & FRAME_FRESH)) {
+      continue;
+    }
+    ch->front = atomic_exchange_explicit(&ch->middle, ch->front, memory_order_acq_rel) & 3;
+    const FrameRequest* req = &ch->requests[ch->front];
+    last = req->last;
+    if (last) {
+      struct iovec iov[2] = { { "\r\033[K", 4 }, { (void*)req->text, req->text_len } };
+      writev(fileno(term_out), iov, 2);
+    } else {
+      const size_t len = render_frame(msg, &req->template, req->renderer, &req->values);
+      write_frame(msg, len, ch->last_frame, &ch->last_frame_len);
+    }
+  }
+  release_render_channel(ch);
+  return NULL;
+}
+
+/* Hands back slot over to render thread, never blocks. */
+static void publish_request() {
+  render->back = atomic_exchange_explicit(&render->middle, render->back | FRAME_FRESH, memory_order_acq_rel) & 3;
+  const uint64_t one = 1;
+  write(render->wake_fd, &one, sizeof(one));
+}
+
+static int start_render_thread() {
+  RenderChannel* ch = calloc(1, sizeof(RenderChannel));
+  if (! ch) {
+    return 0;
+  }
+  ch->wake_fd = eventfd(0, EFD_CLOEXEC);
+  if (ch->wake_fd < 0) {
+    free(ch);
+    return 0;
+  }
+  ch->back = 0;
+  atomic_store(&ch->middle, 1);
+  ch->front = 2;
+  atomic_store(&ch->refs, 2);
+  if (pthread_create(&ch->thread, NULL, render_thread_main, ch) != 0) {
+    close(ch->wake_fd);
+    free(ch);
+    return 0;
+  }
+  render = ch;
+  return 1;
+}
+
+/* Lets render thread clear the last frame and show text, then waits for it,
+   for at most RENDER_EXIT_WAIT_NS if bounded. */
+static void stop_render_thread(const char* text, size_t len, int bounded) {
+  FrameRequest* req = &render->requests[render->back];
+  req->last = 1;
+  memcpy(req->text, text, len);
+  req->text_len = len;
+  publish_request();
+  if (! bounded) {
+    pthread_join(render->thread, NULL);
+  } else {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    const long long until = ts.tv_nsec + RENDER_EXIT_WAIT_NS;
+    ts.tv_sec += until / NSEC_PER_SEC;
+    ts.tv_nsec = until % NSEC_PER_SEC;
+    if (pthread_timedjoin_np(render->thread, NULL, &ts) != 0) {
+      pthread_detach(render->thread);
+    }
+  }
+  release_render_channel(render);
+  render = NULL;
+}
+
+/* Renders message and shows it as a frame, or has the render thread do it if
+   there is one. Unchanged frames are skipped. */
+static void show_frame(const int seconds_left) {
+  if (render) {
+    FrameRequest* req = &render->requests[render->back];
+    snapshot_frame_values(&req->values, seconds_left);
+    req->template = message;
+    req->renderer = message_renderer;
+    req->last = 0;
+    publish_request();
+    return;
+  }
+  char msg[FRAME_MAX_SIZE];
+  FrameValues values;
+  snapshot_frame_values(&values, seconds_left);
+  const size_t len = render_frame(msg, &message, message_renderer, &values);
+  write_frame(msg, len, last_frame, &last_frame_len);
+}
+
+/* Runs a prepared countdown to completion. The deadline is a monotonic time
+   in nanoseconds, or 0 to count down N seconds from now. */
+static void run_countdown(const Settings* settings, long long deadline, CountdownResult* result) {
+  const long long start = monotonic_ns();
+  countdown_start = start;
+  if (deadline == 0) {
+    splay_ns = compute_splay(settings);
+    if (settings->opts & OPT_CRON) {
+      deadline = start_cron_deadline(&settings->cron) + splay_ns;
+      cron_limit = settings->countdown >= 0 ? start + settings->countdown * NSEC_PER_SEC : 0;
+      if (cron_limit && deadline > cron_limit) {
+        deadline = cron_limit;
+      }
+    } else {
+      deadline = start + settings->countdown * NSEC_PER_SEC + splay_ns;
+    }
+  }
+  countdown_deadline = clamp_to_budget(deadline);
+  int exitcode = settings->exitcode;
+
+  const long long latest_deadline = countdown_deadline;
+  const long long progress_interval = settings->progress_interval * NSEC_PER_SEC;
+  long long next_progress_sample = start;
+  long long next_metrics_refresh = start + settings->metrics_interval * NSEC_PER_SEC;
+  countdown_reason = REASON_TIMEOUT;
+  last_frame_len = 0;
+  if ((settings->opts & OPT_RENDER_THREAD) && ! (settings->opts & OPT_SILENT) && ! start_render_thread()) {
+    fprintf(stderr, "Error: cannot start render thread: %s\n", strerror(errno));
+  }
+  int seconds_left = 1;
+  while (seconds_left > 0) {
+    const long long now = monotonic_ns();
+    if (settings->progress && now >= next_progress_sample) {
+      next_progress_sample = now + progress_interval;
+      if (sample_progress(now, next_progress_sample, latest_deadline)) {
+        countdown_reason = REASON_COMPLETE;
+        break;
+      }
+    }
+    const long long deadline = countdown_deadline;
+    long long remaining = deadline - now;
+    if (remaining <= 0) {
+      stats.expiry_late_ns = -remaining;
+      seconds_left = 0;
+      break;
+    }
+    seconds_left = (remaining + NSEC_PER_SEC - 1) / NSEC_PER_SEC;
+
+    if (gate_dir_fd >= 0 && update_gate()) {
+      countdown_reason = REASON_ACQUIRED;
+      break;
+    }
+    if (processes.proc_fd >= 0 && scan_processes() == 0) {
+      countdown_reason = REASON_GONE;
+      break;
+    }
+
+    if (! (settings->opts & OPT_SILENT)) {
+      if (now >= next_metrics_refresh && metrics_in_use()) {
+        refresh_metrics();
+        next_metrics_refresh = now + settings->metrics_interval * NSEC_PER_SEC;
+      }
+      show_frame(seconds_left);
+    }
+    // Nothing is displayed when silent, so sleep until the deadline in one go
+    long long tick = deadline - (seconds_left - 1) * NSEC_PER_SEC;
+    if ((settings->opts & OPT_SILENT) && gate_dir_fd < 0 && ! settings->progress && ! settings->wait_process) {
+      tick = deadline;
+    }
+    if (wait_for_one_second_or_input(tick) == EVENT_EXIT) {
+      break;
+    }
+  }
+  const int elapsed = (monotonic_ns() - start) / NSEC_PER_SEC;
+  if (countdown_reason == REASON_TIMEOUT && (settings->opts & OPT_FAIL_NO_USER_INTERACTION)) {
+    exitcode = 1;
+  }
+  if (settings->gate_dir && countdown_reason != REASON_ACQUIRED) {
+    exitcode = 1;
+  }
+  if (settings->wait_process && countdown_reason != REASON_GONE) {
+    exitcode = 1;
+  }
+  if ((settings->opts & OPT_NOTIFY) && countdown_reason != REASON_READY) {
+    exitcode = countdown_reason == REASON_EXITED && notify_exit_status != 0 ? notify_exit_status : 1;
+  }
+  if (! (settings->opts & OPT_SILENT)) {
+    // Clearing of the last frame and the exit line go out in one write,
+    // whether or not the terminal output is buffered
+    char info[EXIT_TEXT_MAX_SIZE];
+    size_t len = 0;
+    if (! (settings->opts & OPT_SUPPRESS_EXIT_INFO)) {
+      len = snprintf(info, sizeof(info) - 1, _(MSG_EXIT_INFO), exitcode, elapsed);
+      if (len >= sizeof(info) - 1) len = sizeof(info) - 2;
+    }
+    info[len++] = (settings->opts & OPT_SUPPRESS_EXIT_INFO) ? '\r' : '\n';
+    fflush(term_out);
+    if (render) {
+      stop_render_thread(info, len, countdown_reason == REASON_INPUT);
+    } else {
+      struct iovec iov[2] = { { "\r\033[K", 4 }, { info, len } };
+      writev(fileno(term_out), iov, 2);
+    }
+  }
+  if (countdown_reason == REASON_INPUT) {
+    stats.input_to_exit_ns = monotonic_ns() - stats.input_ns;
+  } else if (countdown_reason == REASON_TIMEOUT) {
+    stats.expiry_to_exit_ns = monotonic_ns() - countdown_deadline;
+  }
+
+  result->exitcode = exitcode;
+  result->elapsed = elapsed;
+  result->reason = countdown_reason;
+}
+
+/* Reads proportional set size in kB, or returns -1 if not available. */
+static long read_pss_kb() {
+  char buf[1024];
+  if (read_small_file("/proc/self/smaps_rollup", buf, sizeof(buf)) < 0) {
+    return -1;
+  }
+  const char* pss = strstr(buf, "\nPss:");
+  return pss ? strtol(pss + 5, NULL, 10) : -1;
+}
+
+/* Prints resource usage and timing counters as a single line of key=value
+   pairs on stderr, suitable for aggregating over many instances. */
+static void print_stats() {
+  const int samples = stats.ticks < 1024 ? stats.ticks : 1024;
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  fprintf(stderr, "waitexit-stats pid=%i user_us=%lld sys_us=%lld nvcsw=%ld nivcsw=%ld "
+          "wakeups=%lu frames=%lu frames_skipped=%lu bytes=%lu max_frame_bytes=%zu render_ns=%lld "
+          "maxrss_kb=%ld pss_kb=%ld expiry_late_us=%lld expiry_to_exit_us=%lld input_to_exit_us=%lld "
+          "ticks=%lu tick_late_p50_us=%lld tick_late_p90_us=%lld tick_late_p99_us=%lld "
+          "tick_late_max_us=%lld wake_lead_us=%lld\n",
+          (int)getpid(),
+          ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec,
+          ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec,
+          ru.ru_nvcsw, ru.ru_nivcsw,
+          stats.wakeups, stats.frames, stats.frames_skipped, stats.bytes_written,
+          stats.max_frame_bytes, stats.render_ns, ru.ru_maxrss, read_pss_kb(),
+          stats.expiry_late_ns / 1000, stats.expiry_to_exit_ns / 1000, stats.input_to_exit_ns / 1000,
+          stats.ticks, percentile(stats.tick_late_ns, samples, 50) / 1000,
+          percentile(stats.tick_late_ns, samples, 90) / 1000,
+          percentile(stats.tick_late_ns, samples, 99) / 1000,
+          percentile(stats.tick_late_ns, samples, 100) / 1000, wake.lead_ns / 1000);
+}
+
+/* Returns != 0 if settings select a mode which runs COMMAND. */
+static int runs_command(const Settings* settings) {
+  return settings->gate_dir || (settings->opts & (OPT_REPEAT | OPT_RETRY | OPT_NOTIFY));
+}
+
+/* Runs command to completion with the terminal in its normal mode.
+   Returns exit status of command, or 128 + signal number if killed. */
+static int run_command(char** command) {
+  reset_termio();
+  int status = 0;
+  pid_t pid = fork();
+  if (pid == 0) {
+    restore_sigmask();
+    execvp(command[0], command);
+    fprintf(stderr, "Error: cannot execute %s: %s\n", command[0], strerror(errno));
+    _exit(127);
+  } else if (pid < 0) {
+    fprintf(stderr, "Error: cannot run %s: %s\n", command[0], strerror(errno));
+    status = 127 << 8;
+  } else {
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+  }
+  if (isatty(term_in)) {
+    set_raw_termio();
+  }
+  return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/* Runs command every N seconds on a fixed schedule, counting down to the
+   next run in between, until a key is pressed. When a run overruns its
+   period, missed runs are skipped, or made right away with --catch-up.
+   Returns exit status of the last run. */
+static int run_repeat(const Settings* settings) {
+  Settings between = *settings;
+  between.opts |= OPT_SUPPRESS_EXIT_INFO;
+  between.opts &= ~OPT_FAIL_NO_USER_INTERACTION;
+
+  const long long period = settings->countdown * NSEC_PER_SEC;
+  long long next = monotonic_ns();
+  unsigned long runs = 0;
+  unsigned long skipped = 0;
+  int status;
+  for (;;) {
+    status = run_command(settings->command);
+    ++runs;
+    next += period;
+    const long long now = monotonic_ns();
+    if (next <= now) {
+      if (settings->opts & OPT_CATCH_UP) {
+        if (poll_events_now() == EVENT_EXIT || budget_expired()) break;
+        continue;
+      }
+      long long missed = (now - next) / period + 1;
+      next += missed * period;
+      skipped += missed;
+    }
+    CountdownResult result;
+    run_countdown(&between, next, &result);
+    if (result.reason != REASON_TIMEOUT || budget_expired()) {
+      break;
+    }
+  }
+  if (countdown_reason == REASON_INPUT) {
+    countdown_reason = REASON_STOPPED;
+  }
+  if (! (settings->opts & (OPT_SILENT | OPT_SUPPRESS_EXIT_INFO))) {
+    fprintf(term_out, _(MSG_REPEAT_SUMMARY), runs, skipped, status);
+    fputc('\n', term_out);
+  }
+  return status;
+}
+
+/* Runs command until it succeeds, at most --retry times more after the first
+   attempt. Between attempts, counts down a backoff delay which starts at N
+   seconds and doubles for each attempt, capped by --backoff-max, with a
+   random jitter of up to half the delay subtracted. Pressing q or escape
+   gives up, any other key retries right away. Returns exit status of the
+   last attempt. */
+static int run_retry(const Settings* settings) {
+  Settings between = *settings;
+  between.opts |= OPT_SUPPRESS_EXIT_INFO;
+  between.opts &= ~OPT_FAIL_NO_USER_INTERACTION;
+
+  long long durations[MAX_RETRIES + 1];
+  int statuses[MAX_RETRIES + 1];
+  long long delay = settings->countdown * NSEC_PER_SEC;
+  // Without --backoff-max, doubling stops where seconds left no longer fit
+  const long long delay_max = (settings->backoff_max > 0 ? settings->backoff_max : INT_MAX) * NSEC_PER_SEC;
+  int attempts = 0;
+  int aborted = 0;
+  for (;;) {
+    const long long t0 = monotonic_ns();
+    statuses[attempts] = run_command(settings->command);
+    durations[attempts] = monotonic_ns() - t0;
+    retry_attempt = ++attempts;
+    if (statuses[attempts-1] == 0 || attempts > settings->retries) {
+      break;
+    }
+
+    if (delay > delay_max) {
+      delay = delay_max;
+    }
+    const long long wait = delay - (long long)(random_u64() % (delay / 2 + 1));
+    CountdownResult result;
+    run_countdown(&between, monotonic_ns() + wait, &result);
+    if (result.reason == REASON_INPUT && (input_key == 'q' || input_key == 'Q' || input_key == 27 || input_key < 0)) {
+      aborted = 1;
+      break;
+    }
+    if (budget_expired()) {
+      break;
+    }
+    if (delay < delay_max) {
+      delay *= 2;
+    }
+  }
+
+  const int status = statuses[attempts-1];
+  countdown_reason = status == 0 ? REASON_SUCCEEDED : aborted ? REASON_ABORTED : REASON_GAVE_UP;
+  if (! (settings->opts & (OPT_SILENT | OPT_SUPPRESS_EXIT_INFO))) {
+    for (int i = 0; i < attempts; i++) {
+      fprintf(term_out, _(MSG_RETRY_ATTEMPT), i+1, statuses[i], durations[i] / 1e9);
+      fputc('\n', term_out);
+    }
+    if (status == 0) {
+      fprintf(term_out, _(MSG_RETRY_SUCCEEDED), attempts);
+      fputc('\n', term_out);
+    } else {
+      fprintf(term_out, _(aborted ? MSG_RETRY_ABORTED : MSG_RETRY_GAVE_UP), attempts, status);
+      fputc('\n', term_out);
+    }
+  }
+  return status;
+}
+
+/* Counts up until q, Esc or end of input, or until N seconds have passed if
+   N is given. Any other key records a lap, timed from when the key press
+   was read. Lap times and a summary are printed at the end. Returns exit
+   status. */
+static int run_stopwatch(const Settings* settings) {
+  const long long start = monotonic_ns();
+  countdown_start = start;
+  countdown_deadline = clamp_to_budget(settings->countdown > 0 ? start + settings->countdown * NSEC_PER_SEC : LLONG_MAX);
+  last_frame_len = 0;
+  lap_count = 0;
+  long long lap_start = start;
+  countdown_reason = REASON_TIMEOUT;
+  if ((settings->opts & OPT_RENDER_THREAD) && ! (settings->opts & OPT_SILENT) && ! start_render_thread()) {
+    fprintf(stderr, "Error: cannot start render thread: %s\n", strerror(errno));
+  }
+  for (;;) {
+    const long long now = monotonic_ns();
+    if (now >= countdown_deadline) {
+      break;
+    }
+    stopwatch_elapsed = (now - start) / NSEC_PER_SEC;
+    if (! (settings->opts & OPT_SILENT)) {
+      show_frame(countdown_deadline == LLONG_MAX ? 0 : (countdown_deadline - now + NSEC_PER_SEC - 1) / NSEC_PER_SEC);
+    }
+    long long tick = start + (stopwatch_elapsed + 1) * NSEC_PER_SEC;
+    if (wait_for_one_second_or_input(tick < countdown_deadline ? tick : countdown_deadline) != EVENT_EXIT) {
+      continue;
+    }
+    if (countdown_reason != REASON_INPUT) {
+      break;
+    }
+    lap_ns[lap_count++] = stats.input_ns - lap_start;
+    lap_start = stats.input_ns;
+    if (input_key == 'q' || input_key == 'Q' || input_key == 27 || input_key < 0 || lap_count == MAX_LAPS) {
+      break;
+    }
+    countdown_reason = REASON_TIMEOUT;
+  }
+  if (countdown_reason != REASON_INPUT) {
+    const long long end = monotonic_ns() < countdown_deadline ? monotonic_ns() : countdown_deadline;
+    lap_ns[lap_count++] = end - lap_start;
+  }
+
+  if (render) {
+    stop_render_thread("\r", 1, countdown_reason == REASON_INPUT);
+  } else if (! (settings->opts & OPT_SILENT)) {
+    write(fileno(term_out), "\r\033[K", 4);
+  }
+  if (! (settings->opts & (OPT_SILENT | OPT_SUPPRESS_EXIT_INFO))) {
+    long long total = 0;
+    for (int i = 0; i < lap_count; i++) {
+      total += lap_ns[i];
+      fprintf(term_out, _(MSG_STOPWATCH_LAP), i + 1, lap_ns[i] / 1e9, total / 1e9);
+      fputc('\n', term_out);
+    }
+    fprintf(term_out, _(MSG_STOPWATCH_SUMMARY), lap_count, total / 1e9,
+            percentile(lap_ns, lap_count, 0) / 1e9, percentile(lap_ns, lap_count, 50) / 1e9,
+            total / lap_count / 1e9, percentile(lap_ns, lap_count, 100) / 1e9);
+    fputc('\n', term_out);
+  }
+  if (countdown_reason == REASON_INPUT) {
+    countdown_reason = REASON_STOPPED;
+  }
+  if (countdown_reason == REASON_TIMEOUT && (settings->opts & OPT_FAIL_NO_USER_INTERACTION)) {
+    return 1;
+  }
+  return settings->exitcode;
+}
+
+/* Replaces this process with command, restoring the terminal first. */
+static void exec_command(char** command) {
+  reset_termio();
+  restore_sigmask();
+  execvp(command[0], command);
+  fprintf(stderr, "Error: cannot execute %s: %s\n", command[0], strerror(errno));
+  exit(127);
+}
+
+/* Splits line into words in place, honoring single and double quotes and
+   backslash escapes like a shell would. Returns number of words. */
+static int split_words(char* line, char** words, int max) {
+  int n = 0;
+  char* r = line;
+  char* w = line;
+  for (;;) {
+    while (isspace(*r)) ++r;
+    if (! *r || n == max) break;
+    words[n++] = w;
+    char quote = 0;
+    while (*r && (quote || ! isspace(*r))) {
+      if (quote && *r == quote) {
+        quote = 0;
+        ++r;
+      } else if (! quote && (*r == '\'' || *r == '"')) {
+        quote = *r++;
+      } else {
+        if (*r == '\\' && quote != '\'' && r[1]) ++r;
+        *(w++) = *(r++);
+      }
+    }
+    if (*r) ++r;
+    *(w++) = 0;
+  }
+  return n;
+}
+
+#define COPROC_MAX_ARGS               64
+
+/* Serves countdown requests read line by line from stdin, each line holding
+   the same options and arguments as the command line. For every request a
+   line "EXITCODE ELAPSED REASON" is written to stdout, where REASON is one
+   of timeout, input, help or error. The countdown itself is displayed on
+   the controlling terminal, which is kept configured between requests.
+   A --budget of a request only limits that request, within the budget of
+   the coprocess. Requests without --syslog use the one given to the
+   coprocess, while --stats and --trace-startup cover the whole coprocess
+   and are only accepted on its command line. */
+static int serve_coprocess(const char* self, const Settings* defaults) {
+  int tty = open("/dev/tty", O_RDWR | O_CLOEXEC);
+  if (tty < 0) {
+    fprintf(stderr, "Error: coprocess mode requires a controlling terminal: %s\n", strerror(errno));
+    return 1;
+  }
+  term_in = tty;
+  term_out = fdopen(tty, "w");
+  init_termio();
+
+  const long long coprocess_budget = budget_deadline;
+  char* line = NULL;
+  size_t line_size = 0;
+  while (getline(&line, &line_size, stdin) > 0) {
+    char* args[COPROC_MAX_ARGS+1];
+    int nargs = split_words(line, args + 1, COPROC_MAX_ARGS) + 1;
+    if (nargs == 1) {
+      continue;
+    }
+    args[0] = (char*)self;
+    args[nargs] = NULL;
+
+    Settings settings;
+    optind = 0;
+    if (! parse_arguments(nargs, args, &settings)) {
+      fputs("1 0 error\n", stdout);
+    } else if (settings.opts & OPT_HELP) {
+      print_usage(self);
+      fputs("0 0 help\n", stdout);
+    } else if ((settings.countdown < 0 && ! (settings.opts & OPT_CRON)) || (settings.opts & OPT_COPROC)) {
+      fprintf(stderr, "Error: number of seconds to wait must be specified.\n");
+      fputs("1 0 error\n", stdout);
+    } else if (settings.command || runs_command(&settings)) {
+      fprintf(stderr, "Error: commands cannot be run in coprocess mode.\n");
+      fputs("1 0 error\n", stdout);
+    } else if (settings.opts & OPT_STOPWATCH) {
+      fprintf(stderr, "Error: --stopwatch cannot be used in coprocess mode.\n");
+      fputs("1 0 error\n", stdout);
+    } else if (settings.opts & (OPT_STATS | OPT_TRACE_STARTUP)) {
+      fprintf(stderr, "Error: --stats and --trace-startup can only be given to the coprocess itself.\n");
+      fputs("1 0 error\n", stdout);
+    } else {
+      budget_deadline = coprocess_budget;
+      if (settings.budget > 0) {
+        tighten_budget(settings.budget);
+      }
+      if (! (settings.opts & OPT_SYSLOG) && (defaults->opts & OPT_SYSLOG)) {
+        settings.opts |= OPT_SYSLOG;
+        settings.syslog_label = defaults->syslog_label;
+        settings.syslog_socket = defaults->syslog_socket;
+      }
+      tcflush(term_in, TCIFLUSH);
+      if (prepare_countdown(&settings)) {
+        CountdownResult result;
+        run_countdown(&settings, 0, &result);
+        fprintf(stdout, "%i %i %s\n", result.exitcode, result.elapsed, reason_names[result.reason]);
+        if (settings.opts & OPT_SYSLOG) {
+          send_syslog_record(&settings, result.exitcode, result.elapsed, result.reason);
+        }
+      } else {
+        fputs("1 0 error\n", stdout);
+      }
+      release_countdown();
+    }
+    fflush(stdout);
+  }
+  free(line);
+  return 0;
+}
+
+int main(int argc, char ** argv) {
+  trace_phase(TRACE_MAIN);
+  term_out = stdout;
+  load_catalog();
+  trace_phase(TRACE_CATALOG);
+
+  Settings settings;
+  if (!parse_arguments(argc, argv, &settings)) {
+    return 1;
+  }
+  trace_phase(TRACE_ARGUMENTS);
+
+  if (settings.opts & OPT_HELP) {
+    print_usage(argv[0]);
+    return 0;
+  }
+
+  init_budget(&settings);
+
+  if (settings.opts & OPT_COPROC) {
+    const int status = serve_coprocess(argv[0], &settings);
+    if (settings.opts & OPT_STATS) {
+      print_stats();
+    }
+    if (settings.opts & OPT_TRACE_STARTUP) {
+      print_startup_trace();
+    }
+    return status;
+  }
+
+  if (settings.countdown < 0 && ! (settings.opts & (OPT_CRON | OPT_STOPWATCH))) {
+    fprintf(stderr, "Error: number of seconds to wait must be specified.\n");
+    return 1;
+  }
+  if ((settings.opts & OPT_CRON) && (settings.opts & (OPT_REPEAT | OPT_RETRY | OPT_STOPWATCH))) {
+    fprintf(stderr, "Error: --cron cannot be combined with --repeat, --retry or --stopwatch.\n");
+    return 1;
+  }
+  if (!! settings.gate_dir + !! (settings.opts & OPT_REPEAT) + !! (settings.opts & OPT_RETRY) + !! (settings.opts & OPT_NOTIFY)
+      + !! (settings.opts & OPT_STOPWATCH) > 1) {
+    fprintf(stderr, "Error: only one of --gate, --repeat, --retry, --notify and --stopwatch can be used.\n");
+    return 1;
+  }
+
+  if (runs_command(&settings) && ! settings.command) {
+    fprintf(stderr, "Error: a command to run must be given after N.\n");
+    return 1;
+  }
+  if ((settings.opts & OPT_REPEAT) && settings.countdown == 0) {
+    fprintf(stderr, "Error: --repeat requires a period of at least one second.\n");
+    return 1;
+  }
+  if (settings.command && ! runs_command(&settings)) {
+    fprintf(stderr, "Error: unexpected argument after N: %s\n", settings.command[0]);
+    return 1;
+  }
+
+  if (! prepare_countdown(&settings)) {
+    return 1;
+  }
+  trace_phase(TRACE_PREPARED);
+
+  init_termio();
+  trace_phase(TRACE_TERMIO);
+
+  if (settings.opts & (OPT_REPEAT | OPT_RETRY | OPT_STOPWATCH)) {
+    const long long start = monotonic_ns();
+    int status = (settings.opts & OPT_REPEAT) ? run_repeat(&settings)
+      : (settings.opts & OPT_RETRY) ? run_retry(&settings) : run_stopwatch(&settings);
+    release_countdown();
+    if (settings.opts & OPT_SYSLOG) {
+      send_syslog_record(&settings, status, (monotonic_ns() - start) / NSEC_PER_SEC, countdown_reason);
+    }
+    if (settings.opts & OPT_STATS) {
+      print_stats();
+    }
+    if (settings.opts & OPT_TRACE_STARTUP) {
+      print_startup_trace();
+    }
+    return status;
+  }
+
+  CountdownResult result;
+  run_countdown(&settings, 0, &result);
+  release_countdown();
+  if (settings.opts & OPT_SYSLOG) {
+    send_syslog_record(&settings, result.exitcode, result.elapsed, result.reason);
+  }
+  if (settings.opts & OPT_STATS) {
+    print_stats();
+  }
+  if (settings.opts & OPT_TRACE_STARTUP) {
+    print_startup_trace();
+  }
+  if (result.reason == REASON_ACQUIRED) {
+    exec_command(settings.command);
+  }
+  return result.exitcode;
 }